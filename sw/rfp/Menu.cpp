@@ -147,7 +147,7 @@ void Menu::DrawMenu (void)
 	      (top > 0), items_below);
 
   // Update display
-  display->display();
+  display->commit();
 }
 
 void Menu::KeyHandler(uint8_t k)
@@ -219,8 +219,8 @@ void Menu::KeyHandler(uint8_t k)
 	  cur->flag.evt_hdl_set = 1;
 	  // Add event handler to list
 	  evt_handler_addhandler(cur->menu[cur->flag.selected].evt_handler);
-	  // Send start event
-	  evt_handler_syncevent(EVENT_APP_START, (uint16_t)&sys);
+	  // Send start event, cast is ok bc pointers are 16bit on the target
+	  evt_handler_syncevent(EVENT_APP_START, (uint16_t)(size_t)&sys);
 	}
 
 	// Save ptr to cur menu state
@@ -1,4 +1,5 @@
 #include "cmd_parser.h"
+#include "prof.h"
 
 /* Internal data structure */
 typedef struct {
@@ -12,6 +13,17 @@ static cmd_entry_t cmd_tbl[MAX_CMDS];
 /* Single global, reused for all dispatches */
 static tok_t token;
 
+#ifdef PROFILE
+/* stats [clear] - dump or reset the latency profiler */
+static void cmd_stats (uint8_t argc, tok_t *tok)
+{
+  if (argc && (strcmp(tok->arg[0], "clear") == 0))
+    prof_clear();
+  else
+    prof_dump();
+}
+#endif
+
 void cmdp_init (void)
 {
   uint8_t i;
@@ -20,6 +32,11 @@ void cmdp_init (void)
     cmd_tbl[i].cmd = NULL;
     cmd_tbl[i].cb = (cmd_cb_t)NULL;
   }
+
+#ifdef PROFILE
+  // Built in commands
+  cmdp_register_cmd ("stats", &cmd_stats);
+#endif
 }
 
 uint8_t cmdp_register_cmd (const char *cmd, cmd_cb_t cb)
@@ -31,6 +48,7 @@ uint8_t cmdp_register_cmd (const char *cmd, cmd_cb_t cb)
     if (cmd_tbl[i].cmd == NULL) {
       cmd_tbl[i].cmd = cmd;
       cmd_tbl[i].cb = cb;
+      break;
     }
   }
   return (i != MAX_CMDS) ? 0 : 1;
@@ -64,7 +82,9 @@ void cmdp_parse_cmd (string_t *str)
   }
 
   // Match command
-  for (i = 0; i < MAX_CMDS; i++) {
+  for (i = 0; (i < MAX_CMDS) && token.cmd; i++) {
+    if (cmd_tbl[i].cmd == NULL)
+      continue;
     if (strncmp (cmd_tbl[i].cmd, token.cmd, strlen(cmd_tbl[i].cmd)) == 0) {
       // Dispatch if cb is available
       if (cmd_tbl[i].cb != NULL)
@@ -1,19 +1,29 @@
 #include "evt_handler.h"
+#include "ring.h"
+#include "prof.h"
 #include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
 
-#define MAX_HANDLERS  3
+#define MAX_HANDLERS  8   // bits in a class map
 
-/* Create a singly linked list to track event handlers */
+// Handler slot, no dynamic alloc here
 struct handler_node {
-  event_notify_cb    cb;
-  struct handler_node *next;
+  event_notify_cb cb;
+  uint16_t mask;    // EVT_MASK_* classes handled
+  uint8_t  stacked; // app handler, removed by pophandler
 };
 
-// Static pool of nodes, no dynamic alloc here
+// Static pool of nodes
 static struct handler_node pool[MAX_HANDLERS];
 
-// Head of linked list of handlers
-static struct handler_node *head;
+// Handler chain, pool indices from head to tail
+static uint8_t chain[MAX_HANDLERS];
+static uint8_t chain_len;
+
+// Per event class, bit n set if chain[n] subscribes
+static uint8_t class_map[16];
+static uint8_t chain_gen;   // bumped on every chain change
 
 // Queue for events
 struct event_t {
@@ -21,13 +31,22 @@ struct event_t {
   uint16_t data;
 };
 
-// Buffer size for system events
-#define EVENT_Q_SIZE  5
-struct event_t event_q[EVENT_Q_SIZE];
-uint8_t q_head = 0;
-uint8_t q_tail = 0;
+// One queue per priority class, posted from ISRs and main loop
+#define EVENT_Q_RF_SIZE     16
+#define EVENT_Q_INPUT_SIZE  8
+#define EVENT_Q_HOUSE_SIZE  4
+static MpRing<struct event_t, EVENT_Q_RF_SIZE> q_rf;
+static MpRing<struct event_t, EVENT_Q_INPUT_SIZE> q_input;
+static MpRing<struct event_t, EVENT_Q_HOUSE_SIZE> q_house;
 
-#define NEXT(x) ((x==EVENT_Q_SIZE-1) ? 0: x+1)
+// Idempotent events, only the latest data is kept
+static const uint8_t coalesce_evt[] = {
+  EVENT_VBATT,
+  EVENT_ICON_UPDT,
+};
+#define NUM_COALESCE  (sizeof(coalesce_evt) / sizeof(coalesce_evt[0]))
+static volatile uint8_t coalesce_pend;
+static volatile uint16_t coalesce_data[NUM_COALESCE];
 
 // Method to grab a new node from the pool
 static struct handler_node *get_node (void)
@@ -41,81 +60,210 @@ static struct handler_node *get_node (void)
   return NULL;
 }
 
-void evt_handler_event(uint8_t event, uint16_t data)
+// Recompute class lookup after the chain changed
+static void rebuild_class_map (void)
 {
-  if (NEXT(q_head) == q_tail)
-    return;
+  uint8_t c, n;
+
+  chain_gen++;
+  for (c = 0; c < 16; c++) {
+    class_map[c] = 0;
+    for (n = 0; n < chain_len; n++) {
+      if (pool[chain[n]].mask & (1 << c))
+	class_map[c] |= (1 << n);
+    }
+  }
+}
+
+// Call subscribers in chain order until one handles the event
+static void deliver (uint8_t event, uint16_t data)
+{
+  uint8_t n, m = class_map[EVT_CLASS(event)];
+  uint8_t gen = chain_gen;
+
+  for (n = 0; m; n++, m >>= 1) {
+    if (!(m & 1))
+      continue;
+    // Stop if the handler consumed it or pushed/popped handlers
+    uint8_t slot = chain[n], done;
+    PROF_ENTER();
+    done = pool[slot].cb(event, data);
+    PROF_EXIT(PROF_HANDLER + slot);
+    if (done || (gen != chain_gen))
+      return;
+  }
+}
+
+uint8_t evt_handler_prio (uint8_t event)
+{
+  if ((event & 0xe0) == 0x40)
+    return EVT_PRIO_RF;
+  if ((event == EVENT_KEYPRESS) || (event >= EVENT_APP_START))
+    return EVT_PRIO_INPUT;
+  return EVT_PRIO_HOUSE;
+}
+
+uint8_t evt_handler_event(uint8_t event, uint16_t data)
+{
+  struct event_t e;
+  uint8_t i, sreg;
 
   //debug("Evt=%02x", event);
-  // Store event
-  event_q[q_head].event = event;
-  event_q[q_head].data = data;
-  q_head = NEXT(q_head);
+  // Overwrite a pending idempotent event
+  for (i = 0; i < NUM_COALESCE; i++) {
+    if (coalesce_evt[i] == event) {
+      sreg = SREG;
+      cli();
+      coalesce_data[i] = data;
+      coalesce_pend |= (1 << i);
+      SREG = sreg;
+      return 1;
+    }
+  }
+
+  // Store event, dropped events are counted by the queue
+  e.event = event;
+  e.data = data;
+  switch (evt_handler_prio(event)) {
+    case EVT_PRIO_RF:
+      return q_rf.push(e);
+    case EVT_PRIO_INPUT:
+      return q_input.push(e);
+    default:
+      return q_house.push(e);
+  }
+}
+
+// Take the next pending coalesced event
+static uint8_t coalesce_pop (struct event_t *e)
+{
+  uint8_t i, sreg, ret = 0;
+
+  sreg = SREG;
+  cli();
+  for (i = 0; i < NUM_COALESCE; i++) {
+    if (coalesce_pend & (1 << i)) {
+      coalesce_pend &= ~(1 << i);
+      e->event = coalesce_evt[i];
+      e->data = coalesce_data[i];
+      ret = 1;
+      break;
+    }
+  }
+  SREG = sreg;
+  return ret;
+}
+
+uint8_t evt_handler_hwm (uint8_t prio)
+{
+  if (prio == EVT_PRIO_RF)
+    return q_rf.high_water();
+  if (prio == EVT_PRIO_INPUT)
+    return q_input.high_water();
+  return q_house.high_water();
+}
+
+uint16_t evt_handler_drops (uint8_t prio)
+{
+  if (prio == EVT_PRIO_RF)
+    return q_rf.dropped();
+  if (prio == EVT_PRIO_INPUT)
+    return q_input.dropped();
+  return q_house.dropped();
 }
 
 void evt_handler_init(void)
 {
   uint8_t i;
-  head = NULL;
 
   // Make sure all nodes are NULL
   for (i = 0; i < MAX_HANDLERS; i++) {
     pool[i].cb = NULL;
-    pool[i].next = NULL;
+    pool[i].mask = 0;
   }
+  chain_len = 0;
+  rebuild_class_map();
 }
 
-// Add handler to the list of handlers
-void evt_handler_addhandler (event_notify_cb cb)
+// Services go to the head of the chain, app handlers right behind them
+static void push_node (event_notify_cb cb, uint16_t mask, uint8_t stacked)
 {
+  struct handler_node *n;
+  uint8_t i, pos = 0;
+
   if (cb == NULL)
     return;
 
   // Get node
-  struct handler_node *n = get_node();
+  n = get_node();
   if (n == NULL)
     return;
   n->cb = cb;
+  n->mask = mask;
+  n->stacked = stacked;
 
-  // Push to the head of the list
-  n->next = head;
-  head = n;
+  if (stacked) {
+    while ((pos < chain_len) && !pool[chain[pos]].stacked)
+      pos++;
+  }
+  for (i = chain_len; i > pos; i--)
+    chain[i] = chain[i - 1];
+  chain[pos] = n - pool;
+  chain_len++;
+  rebuild_class_map();
+}
+
+// Add handler to the list of handlers
+void evt_handler_addhandler (event_notify_cb cb)
+{
+  push_node(cb, EVT_MASK_ALL, 1);
+}
+
+void evt_handler_subscribe (event_notify_cb cb, uint16_t mask)
+{
+  push_node(cb, mask, 0);
 }
 
 void evt_handler_pophandler (void)
 {
-  // Pop the head off the list
-  if (head != NULL)
-    head->cb = NULL;
-  else
+  uint8_t i;
+
+  // Pop the most recent app handler, services stay
+  for (i = 0; i < chain_len; i++) {
+    if (pool[chain[i]].stacked)
+      break;
+  }
+  if (i == chain_len)
     return;
 
-  head = head->next;
+  pool[chain[i]].cb = NULL;
+  for (chain_len--; i < chain_len; i++)
+    chain[i] = chain[i + 1];
+  rebuild_class_map();
 }
 
 void evt_handler_syncevent (uint8_t event, uint16_t data)
 {
-  struct handler_node *tmp;
+  deliver(event, data);
+}
 
-  for (tmp = head; tmp != NULL; tmp = tmp->next) {
-    if (tmp->cb(event, data))
-      return;
-  }
+uint8_t evt_handler_pending (void)
+{
+  return !q_rf.empty() || !q_input.empty() || coalesce_pend ||
+    !q_house.empty();
 }
 
 void evt_handler_dispatch (void)
 {
-  struct handler_node *tmp;
+  struct event_t e;
 
-  // Process all events in q
-  while (q_tail != q_head) {
-    //debug("q_tail=[%u]", q_tail);
-    //debug("q_head=[%u]", q_head);
-    // Loop through all EventHandlers until event is handled
-    for (tmp = head; tmp != NULL; tmp = tmp->next) {
-      if (tmp->cb(event_q[q_tail].event, event_q[q_tail].data))
-	break;
-    }
-    q_tail = NEXT(q_tail);
+  // Highest class first, RF is checked again before every lower class
+  // event so it never waits for more than one handler
+  for (;;) {
+    if (!q_rf.pop(e) && !q_input.pop(e) && !coalesce_pop(&e) &&
+	!q_house.pop(e))
+      break;
+
+    deliver(e.event, e.data);
   }
 }
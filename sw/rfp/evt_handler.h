@@ -11,10 +11,42 @@
 typedef uint8_t (*event_notify_cb) (uint8_t event, uint16_t data);
 
 void evt_handler_init(void);
+// Event classes are the high nibble of the event code
+#define EVT_CLASS(evt)   ((evt) >> 4)
+#define EVT_MASK(evt)    (1 << EVT_CLASS(evt))
+#define EVT_MASK_SYS     EVT_MASK(EVENT_KEYPRESS)
+#define EVT_MASK_APP     EVT_MASK(EVENT_APP_START)
+#define EVT_MASK_SERIAL  EVT_MASK(EVENT_SERIAL_RECV)
+#define EVT_MASK_RF_IRQ  EVT_MASK(EVENT_RF_IRQ)
+#define EVT_MASK_RF      EVT_MASK(EVENT_RF_RX_DATA)
+#define EVT_MASK_TIMER   EVT_MASK(EVENT_TIMER)
+#define EVT_MASK_ALL     0xffff
+
+// App handlers get every class and are pushed/popped as apps nest.
+// Subscribers are background services that only see the classes in mask
+// and stay registered. Services are called before app handlers, each
+// group newest first.
 void evt_handler_addhandler (event_notify_cb cb);
+void evt_handler_subscribe (event_notify_cb cb, uint16_t mask);
 void evt_handler_pophandler (void);
-void evt_handler_event (uint8_t event, uint16_t data);
+// Returns 0 if the event was dropped, its queue is full
+uint8_t evt_handler_event (uint8_t event, uint16_t data);
 void evt_handler_syncevent (uint8_t event, uint16_t data);
 void evt_handler_dispatch (void);
+uint8_t evt_handler_pending (void);
+
+// Priority classes, dispatched highest first. VBATT and ICON_UPDT are
+// coalesced, a new one replaces a pending one, and go out as housekeeping.
+enum {
+  EVT_PRIO_RF = 0,   // 0x40-0x5F radio irq and driver events
+  EVT_PRIO_INPUT,    // keys, app, serial and deferred timers
+  EVT_PRIO_HOUSE,    // everything else
+  EVT_PRIO_MAX
+};
+uint8_t evt_handler_prio (uint8_t event);
+
+// Per class queue statistics, peak depth and events lost to a full queue
+uint8_t evt_handler_hwm (uint8_t prio);
+uint16_t evt_handler_drops (uint8_t prio);
 
 #endif /* _EVT_HANDLER_H_ */
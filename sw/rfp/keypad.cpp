@@ -5,6 +5,7 @@
 #include "system.h"
 #include "keypad.h"
 #include "evt_handler.h"
+#include "prof.h"
 
 // Thresholds for keycodes
 #define KEY_DOWN_TH   20
@@ -29,6 +30,7 @@ static void vbatt_read_cb(uint16_t ticks);
 ISR(ADC_vect)
 {
   uint8_t val, keycode = 0;
+  PROF_ENTER();
 
   // Clear interrupt enable bit
   ADCSRA |= (1<<ADIE);
@@ -73,6 +75,7 @@ ISR(ADC_vect)
     evt_handler_event(EVENT_KEYPRESS, (uint16_t)keycode);
 
   last_keycode = keycode;
+  PROF_EXIT(PROF_ADC);
 }
 
 uint8_t keypad_lastkeycode(void)
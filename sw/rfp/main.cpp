@@ -23,7 +23,7 @@ int main (int argc, char **argv)
   // do nothing
   while(1) {
     // Usb processing
-    //ser.process(); done on timer
+    //ser.process(); done by deferred timer
 
     // Update ui
     ui_process();
@@ -0,0 +1,248 @@
+/*
+ * Table driven packet encoder/decoder for packet_format_t.
+ */
+#include <string.h>
+
+#include <avr/pgmspace.h>
+
+#include "pkt_codec.h"
+
+// Line codes, chip patterns msb first
+typedef struct {
+  uint8_t chips;
+  uint8_t sym[2];   // payload bit 0, 1
+} encode_desc_t;
+
+static const encode_desc_t encode_tbl[ENCODE_MAX] PROGMEM = {
+  { 3, { 0x6, 0x4 } },  // ENCODE_KEELOQ_PCM: 0 = 110, 1 = 100
+  { 2, { 0x1, 0x2 } },  // ENCODE_MANCHESTER: 0 = 01,  1 = 10
+  { 1, { 0x0, 0x1 } },  // ENCODE_NRZ:        0 = 0,   1 = 1
+};
+
+const packet_format_t keeloq_format PROGMEM = {
+    400, // 400us bit time
+    1,   // preamble hi = 1 bit
+    2,   // preamble lo = 2 bit
+    6,   // 6 preamble bits
+    10,  // header hi = 4ms = 10 bits
+    10,  // header lo = 4ms = 10 bits
+    ENCODE_KEELOQ_PCM, // pulse coded modulation
+    66   // 66 bits = 28(serial) + 32(ci) + 4(fn) + 2(chksum)
+};
+
+// Majority of os samples -> chip, indexed by sample bits
+static const uint8_t popcnt4[16] PROGMEM = {
+  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+uint8_t pkt_codec_init (pkt_codec_t *c, const packet_format_t *fmt_P,
+			uint8_t os)
+{
+  encode_desc_t e;
+
+  memcpy_P(&c->fmt, fmt_P, sizeof(c->fmt));
+  if (c->fmt.encoding >= ENCODE_MAX || os == 0 || os > PKT_MAX_OS)
+    return 0;
+  memcpy_P(&e, &encode_tbl[c->fmt.encoding], sizeof(e));
+
+  c->os = os;
+  c->chips = e.chips;
+  c->sym[0] = e.sym[0];
+  c->sym[1] = e.sym[1];
+
+  // Reverse table for the decoder
+  memset(c->dec, 0xff, sizeof(c->dec));
+  c->dec[e.sym[0]] = 0;
+  c->dec[e.sym[1]] = 1;
+
+  // Pulse lengths round to the nearest chip count
+  c->q[0] = c->fmt.bit_time_us + c->fmt.bit_time_us / 2;
+  c->q[1] = c->q[0] + c->fmt.bit_time_us;
+  c->q[2] = c->q[1] + c->fmt.bit_time_us;
+  return 1;
+}
+
+uint32_t pkt_codec_bps (const pkt_codec_t *c)
+{
+  return (1000000UL * c->os) / c->fmt.bit_time_us;
+}
+
+/*
+ * Encoder
+ */
+typedef struct {
+  uint8_t *buf;
+  uint8_t sz;
+  uint16_t bit;
+} bit_writer_t;
+
+// Append a chip os times, msb first
+static void put_chip (bit_writer_t *w, const pkt_codec_t *c, uint8_t level)
+{
+  uint8_t i;
+
+  for (i = 0; i < c->os; i++, w->bit++) {
+    if ((w->bit >> 3) >= w->sz)
+      return;
+    if (level)
+      w->buf[w->bit >> 3] |= 0x80 >> (w->bit & 7);
+  }
+}
+
+static void put_run (bit_writer_t *w, const pkt_codec_t *c, uint8_t level,
+		     uint8_t cnt)
+{
+  while (cnt--)
+    put_chip(w, c, level);
+}
+
+uint8_t pkt_encode (const pkt_codec_t *c, const uint8_t *payload,
+		    uint8_t *fifo, uint8_t sz)
+{
+  bit_writer_t w;
+  uint8_t i, j, sym;
+  uint16_t nbits;
+
+  // Make sure everything fits before we start
+  nbits = (uint16_t)c->fmt.preamble_len *
+    (c->fmt.preamble_hi_bc + c->fmt.preamble_lo_bc);
+  nbits += c->fmt.header_hi_bc + c->fmt.header_lo_bc;
+  nbits += (uint16_t)c->fmt.data_bc * c->chips;
+  nbits *= c->os;
+  if (((nbits + 7) >> 3) > sz)
+    return 0;
+
+  w.buf = fifo;
+  w.sz = sz;
+  w.bit = 0;
+  memset(fifo, 0, (nbits + 7) >> 3);
+
+  for (i = 0; i < c->fmt.preamble_len; i++) {
+    put_run(&w, c, 1, c->fmt.preamble_hi_bc);
+    put_run(&w, c, 0, c->fmt.preamble_lo_bc);
+  }
+  put_run(&w, c, 1, c->fmt.header_hi_bc);
+  put_run(&w, c, 0, c->fmt.header_lo_bc);
+
+  // One table lookup per payload bit
+  for (i = 0; i < c->fmt.data_bc; i++) {
+    sym = c->sym[(payload[i >> 3] >> (i & 7)) & 1];
+    for (j = c->chips; j > 0; j--)
+      put_chip(&w, c, (sym >> (j - 1)) & 1);
+  }
+
+  return (nbits + 7) >> 3;
+}
+
+/*
+ * Decoder. Both inputs are reduced to a chip stream that runs through the
+ * same state machine: wait for header_hi_bc high chips followed by
+ * header_lo_bc low ones, then map every `chips` chips through the reverse
+ * table, whatever level the first one has.
+ */
+typedef struct {
+  uint8_t *payload;
+  uint8_t one_run;    // consecutive high chips while hunting for header
+  uint8_t zero_run;   // consecutive low chips after them
+  uint8_t in_data;
+  uint8_t sym, cnt;   // symbol being assembled
+  uint8_t bits;       // payload bits recovered
+  uint8_t done;
+} chip_dec_t;
+
+static void dec_chip (chip_dec_t *d, const pkt_codec_t *c, uint8_t level)
+{
+  uint8_t b;
+
+  if (d->done)
+    return;
+
+  if (!d->in_data) {
+    if (level) {
+      if (d->zero_run) {
+	d->one_run = 0;
+	d->zero_run = 0;
+      }
+      if (d->one_run < 0xff)
+	d->one_run++;
+      return;
+    }
+    // Only a gap behind the header high run counts, a shorter high run
+    // (preamble) starts the hunt over
+    if (d->one_run < c->fmt.header_hi_bc) {
+      d->one_run = 0;
+      return;
+    }
+    if (++d->zero_run == c->fmt.header_lo_bc)
+      d->in_data = 1;
+    return;
+  }
+
+  d->sym = (d->sym << 1) | level;
+  if (++d->cnt < c->chips)
+    return;
+
+  b = c->dec[d->sym & ((1 << c->chips) - 1)];
+  d->sym = d->cnt = 0;
+  if (b > 1) {
+    d->done = 1;
+    return;
+  }
+  if (b)
+    d->payload[d->bits >> 3] |= 1 << (d->bits & 7);
+  if (++d->bits == c->fmt.data_bc)
+    d->done = 1;
+}
+
+static void dec_init (chip_dec_t *d, const pkt_codec_t *c, uint8_t *payload)
+{
+  memset(d, 0, sizeof(*d));
+  d->payload = payload;
+  memset(payload, 0, (c->fmt.data_bc + 7) >> 3);
+}
+
+uint8_t pkt_decode_bits (const pkt_codec_t *c, const uint8_t *fifo,
+			 uint16_t nbits, uint8_t *payload)
+{
+  chip_dec_t d;
+  uint16_t bit;
+  uint8_t i, s;
+
+  dec_init(&d, c, payload);
+
+  // Majority vote os samples into one chip
+  for (bit = 0; (bit + c->os <= nbits) && !d.done; ) {
+    for (s = 0, i = 0; i < c->os; i++, bit++)
+      s = (s << 1) | ((fifo[bit >> 3] >> (7 - (bit & 7))) & 1);
+    dec_chip(&d, c, pgm_read_byte(&popcnt4[s]) * 2 > c->os);
+  }
+  return d.bits;
+}
+
+uint8_t pkt_decode_pulses (const pkt_codec_t *c, const uint16_t *pulses,
+			   uint8_t n, uint8_t first_level, uint8_t *payload)
+{
+  chip_dec_t d;
+  uint8_t i, level = first_level, units;
+
+  dec_init(&d, c, payload);
+
+  for (i = 0; (i < n) && !d.done; i++, level ^= 1) {
+    uint16_t p = pulses[i], r;
+
+    // Round to whole chips, up to 3 without a divide. Longer ones are
+    // header runs, possibly merged with the first data chip.
+    if (p < c->q[2])
+      units = 1 + (p >= c->q[0]) + (p >= c->q[1]);
+    else {
+      r = p / c->fmt.bit_time_us;
+      if (p - r * c->fmt.bit_time_us >= c->fmt.bit_time_us / 2)
+	r++;
+      units = (r > 0xff) ? 0xff : r;
+    }
+
+    while (units--)
+      dec_chip(&d, c, level);
+  }
+  return d.bits;
+}
@@ -0,0 +1,54 @@
+#ifndef _PKT_CODEC_H_
+#define _PKT_CODEC_H_
+/*
+ * Table driven packet encoder/decoder for packet_format_t.
+ *
+ * Every format is preamble_len x (preamble_hi_bc ones, preamble_lo_bc
+ * zeros), then header_hi_bc ones and header_lo_bc zeros, then data_bc
+ * payload bits (lsb of byte 0 first). Each payload bit becomes the chip
+ * pattern of its encoding, a chip being one bit_time_us. The FIFO stream
+ * carries os bits per chip, msb first.
+ *
+ * pkt_codec_init() expands a format into lookup tables once, after that
+ * encode and decode cost the same for every bit. New remotes only need a
+ * packet_format_t entry, plus an encode table row for new line codes.
+ */
+#include <stdint.h>
+
+#include "si4432.h"
+
+#define PKT_MAX_CHIPS  3    // chips per payload bit
+#define PKT_MAX_OS     4    // fifo bits per chip
+
+// Known formats (PROGMEM)
+extern const packet_format_t keeloq_format;
+
+// Expanded format
+typedef struct {
+  packet_format_t fmt;
+  uint8_t  os;                       // fifo bits per chip
+  uint8_t  chips;                    // chips per payload bit
+  uint8_t  sym[2];                   // chip pattern for 0 and 1, msb first
+  uint8_t  dec[1 << PKT_MAX_CHIPS];  // chip pattern -> bit, 0xff invalid
+  uint16_t q[3];                     // pulse quantizer, 1.5, 2.5, 3.5 chips
+} pkt_codec_t;
+
+// Build tables for a PROGMEM format, returns 0 if unsupported
+uint8_t pkt_codec_init (pkt_codec_t *c, const packet_format_t *fmt_P,
+			uint8_t os);
+
+// FIFO data rate for this codec
+uint32_t pkt_codec_bps (const pkt_codec_t *c);
+
+// Encode payload into fifo, returns bytes used or 0 if sz is too small
+uint8_t pkt_encode (const pkt_codec_t *c, const uint8_t *payload,
+		    uint8_t *fifo, uint8_t sz);
+
+// Decode a fifo bitstream or raw capture pulses (us, alternating levels
+// starting with first_level). Return number of payload bits recovered.
+uint8_t pkt_decode_bits (const pkt_codec_t *c, const uint8_t *fifo,
+			 uint16_t nbits, uint8_t *payload);
+uint8_t pkt_decode_pulses (const pkt_codec_t *c, const uint16_t *pulses,
+			   uint8_t n, uint8_t first_level, uint8_t *payload);
+
+#endif /* _PKT_CODEC_H_ */
@@ -0,0 +1,114 @@
+/*
+ * Latency profiler
+ */
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "prof.h"
+#include "timetick.h"
+#include "usb_serial.h"
+
+#ifdef PROFILE
+
+static prof_t prof_tbl[PROF_SITES];
+
+// Site names, handlers are printed by slot
+static const char prof_names[PROF_HANDLER][6] PROGMEM = {
+  "rfirq", "adc", "tick", "disp", "dspi"
+};
+
+// Next site to print
+static uint8_t dump_idx = PROF_SITES;
+
+void prof_record (uint8_t site, uint16_t us)
+{
+  prof_t *p = &prof_tbl[site];
+  uint8_t sreg = SREG;
+
+  cli();
+  if (!p->cnt || (us < p->min))
+    p->min = us;
+  if (us > p->max)
+    p->max = us;
+  p->sum += us;
+  p->cnt++;
+
+  // Halve on count wrap so the average stays valid
+  if (p->cnt == 0xffff) {
+    p->cnt >>= 1;
+    p->sum >>= 1;
+  }
+  SREG = sreg;
+}
+
+void prof_get (uint8_t site, prof_t *p)
+{
+  uint8_t sreg = SREG;
+
+  cli();
+  *p = prof_tbl[site];
+  SREG = sreg;
+}
+
+void prof_clear (void)
+{
+  uint8_t sreg = SREG;
+
+  cli();
+  memset(prof_tbl, 0, sizeof(prof_tbl));
+  SREG = sreg;
+}
+
+static void prof_dump_next (uint16_t ticks);
+
+// Queue the next line, a full timer list ends the dump
+static void dump_schedule (void)
+{
+  if (timetick_oneshot_deferred(&prof_dump_next, 3))
+    return;
+  dump_idx = PROF_SITES;
+  ser.printf("stats: no timer, dump cut short\r\n");
+}
+
+// Deferred timer, one line per run so the serial queue never overflows
+static void prof_dump_next (uint16_t ticks)
+{
+  prof_t p;
+  uint16_t avg;
+
+  // Skip sites that never ran
+  do {
+    prof_get(dump_idx, &p);
+  } while (!p.cnt && (++dump_idx < PROF_SITES));
+  if (dump_idx >= PROF_SITES)
+    return;
+
+  avg = p.sum / p.cnt;
+  if (dump_idx < PROF_HANDLER)
+    ser.printf("%S %u/%u/%u n%u\r\n", prof_names[dump_idx],
+	       p.min, avg, p.max, p.cnt);
+  else
+    ser.printf("h%u %u/%u/%u n%u\r\n", dump_idx - PROF_HANDLER,
+	       p.min, avg, p.max, p.cnt);
+
+  if (++dump_idx < PROF_SITES)
+    dump_schedule();
+}
+
+void prof_dump (void)
+{
+  // Already running
+  if (dump_idx < PROF_SITES) {
+    ser.printf("stats: busy\r\n");
+    return;
+  }
+
+  ser.printf("site min/avg/max us\r\n");
+  dump_idx = 0;
+  dump_schedule();
+}
+
+#endif /* PROFILE */
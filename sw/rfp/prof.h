@@ -0,0 +1,46 @@
+#ifndef _PROF_H_
+#define _PROF_H_
+/*
+ * Latency profiler. PROF_ENTER/PROF_EXIT bracket a code path and record
+ * its duration against the Timer3 timebase (1us = 8 cycles) into a fixed
+ * table of min/max/sum/count per site. Paths run from the main loop also
+ * count the time of any ISR that preempts them.
+ *
+ * Compiled out unless PROFILE is defined, build with make PROFILE=1.
+ */
+#include <stdint.h>
+#include <avr/io.h>
+
+typedef enum {
+  PROF_RF_IRQ = 0,    // ISR(PCINT0_vect)
+  PROF_ADC,           // ISR(ADC_vect)
+  PROF_TICK,          // ISR(TIMER0_COMPA_vect)
+  PROF_DISPLAY,       // ssd1306::display()
+  PROF_DISP_ISR,      // ISR(SPI_STC_vect), background refresh byte
+  PROF_HANDLER,       // event handler, + handler pool slot
+  PROF_SITES = PROF_HANDLER + 8
+} prof_site_t;
+
+typedef struct {
+  uint16_t min;
+  uint16_t max;
+  uint32_t sum;
+  uint16_t cnt;
+} prof_t;
+
+#ifdef PROFILE
+#define PROF_ENTER()      uint16_t _prof_t0 = TCNT3
+#define PROF_EXIT(site)   prof_record((site), TCNT3 - _prof_t0)
+#else
+#define PROF_ENTER()
+#define PROF_EXIT(site)
+#endif
+
+void prof_record (uint8_t site, uint16_t us);
+void prof_get (uint8_t site, prof_t *p);
+void prof_clear (void);
+
+// Print the table over serial, one site per line as the queue drains
+void prof_dump (void);
+
+#endif /* _PROF_H_ */
@@ -96,7 +96,7 @@ static void dump_rf_regs (uint8_t start)
     start += REG_PER_LINE;
   }
   // Display
-  sys->disp->display();
+  sys->disp->commit();
 }
 
 /* Dummy menu */
@@ -0,0 +1,290 @@
+/*
+ * Raw pulse capture on rf_gpio (Si4432 GPIO2 = RX data).
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "rf_raw.h"
+#include "timebase.h"
+#include "hw.h"
+
+volatile uint8_t rf_raw_active;
+volatile uint8_t rf_raw_head;
+volatile uint8_t rf_raw_tail;
+volatile uint8_t rf_raw_wraps;
+volatile uint16_t rf_raw_last;
+volatile uint16_t rf_raw_ovf;
+uint16_t rf_raw_buf[RF_RAW_BUF_SZ];
+
+// Level before the first recorded edge
+static uint8_t first_level;
+// Radio irq pin mask state before the capture
+static uint8_t irq_mask;
+static uint32_t start_us;
+
+// Replay state
+static const uint16_t *tx_pulses;
+static uint8_t tx_base, tx_mask;
+static uint8_t tx_n, tx_idx, tx_loops, tx_first, tx_gap;
+static uint8_t tx_pcie, tx_short;
+static volatile uint8_t tx_active;
+static uint8_t tx_radio;   // radio left in TX, restored from main context
+
+// OC1A action on next compare match
+#define OC1A_CLEAR  (1 << COM1A1)
+#define OC1A_SET    ((1 << COM1A1) | (1 << COM1A0))
+
+// Extend Timer1 so long gaps saturate instead of aliasing
+ISR(TIMER1_OVF_vect)
+{
+  if (rf_raw_wraps < 2)
+    rf_raw_wraps++;
+}
+
+void rf_raw_capture_start (void)
+{
+  rf_raw_head = rf_raw_tail = 0;
+  rf_raw_ovf = 0;
+  rf_raw_wraps = 0;
+
+  // Timer1 free running, clk/8 = 1us
+  TCCR1A = 0;
+  TCCR1C = 0;
+  cli();
+  TCCR1B = (1 << CS11);
+  TCNT1 = 0;
+  start_us = timebase_us_isr();
+  rf_raw_last = 0;
+  TIFR1 = (1 << TOV1);
+  TIMSK1 = (1 << TOIE1);
+
+  // Radio irq is not serviced while capturing, rf_gpio edges are
+  INPUT(rf_gpio);
+  first_level = READ(rf_gpio) ? 1 : 0;
+  irq_mask = PCMSK0 & rf_irq_PIN;
+  PCMSK0 = (PCMSK0 & ~rf_irq_PIN) | rf_gpio_PIN;
+  rf_raw_active = 1;
+  PCIFR = 1;
+  PCICR = 1;
+  sei();
+
+  // Turn on reciever
+  rf_spi_write(0x7, 0x5);
+}
+
+void rf_raw_capture_stop (void)
+{
+  uint8_t sreg;
+
+  if (!rf_raw_active)
+    return;
+
+  // Radio irq is serviced again if it was before
+  sreg = SREG;
+  cli();
+  PCMSK0 = (PCMSK0 & ~rf_gpio_PIN) | irq_mask;
+  rf_raw_active = 0;
+  SREG = sreg;
+  TIMSK1 = 0;
+  TCCR1B = 0;
+
+  // Back to ready mode
+  rf_spi_write(0x7, 0x1);
+}
+
+uint8_t rf_raw_avail (void)
+{
+  return (rf_raw_head - rf_raw_tail) & (RF_RAW_BUF_SZ - 1);
+}
+
+uint8_t rf_raw_read (uint16_t *buf, uint8_t sz)
+{
+  uint8_t n = 0, tail = rf_raw_tail;
+
+  while ((n < sz) && (tail != rf_raw_head)) {
+    buf[n++] = rf_raw_buf[tail];
+    tail = (tail + 1) & (RF_RAW_BUF_SZ - 1);
+  }
+  rf_raw_tail = tail;
+  return n;
+}
+
+uint16_t rf_raw_overflows (void)
+{
+  uint16_t o;
+  uint8_t sreg = SREG;
+
+  cli();
+  o = rf_raw_ovf;
+  SREG = sreg;
+  return o;
+}
+
+uint8_t rf_raw_first_level (void)
+{
+  return first_level;
+}
+
+uint32_t rf_raw_start_us (void)
+{
+  return start_us;
+}
+
+static inline uint16_t tx_pulse (uint8_t idx)
+{
+  uint16_t d = tx_pulses[(tx_base + idx) & tx_mask];
+  return (d < RF_RAW_MIN_PULSE) ? RF_RAW_MIN_PULSE : d;
+}
+
+// Level after pulse idx. Loops are joined by a toggle, low after the last
+static inline uint8_t tx_next_level (uint8_t idx)
+{
+  if ((++idx == tx_n) && (tx_loops == 1))
+    return 0;
+  return tx_first ^ (idx & 1);
+}
+
+// Next edge d us after the last one
+static inline void tx_next (uint16_t d, uint8_t level)
+{
+  uint16_t next = OCR1A + d;
+
+  // Reload came too late, push the edge out instead of a full wrap
+  if ((uint16_t)(next - TCNT1) > d)
+    next = TCNT1 + 4;
+  OCR1A = next;
+  TCCR1A = level ? OC1A_SET : OC1A_CLEAR;
+}
+
+// Stop driving the pin, the radio itself is left to rf_raw_replay_stop()
+static void tx_finish (void)
+{
+  TIMSK1 = 0;
+  TCCR1B = 0;
+  TCCR1A = 0;
+  LOW(rf_gpio);
+  INPUT(rf_gpio);
+  tx_active = 0;
+  PCICR |= tx_pcie;
+}
+
+// Pin just switched to the level of pulse tx_idx + 1, or to the gap
+ISR(TIMER1_COMPA_vect)
+{
+  uint8_t idx = tx_idx + 1;
+
+  if (tx_gap) {
+    // Gap done, pin is at the first level again
+    tx_gap = 0;
+    idx = 0;
+  }
+  else if (idx == tx_n) {
+    if (--tx_loops == 0) {
+      tx_finish();
+      evt_handler_event(EVENT_RF_RAW_TX_DONE, 0);
+      return;
+    }
+    // Pin toggled away from the last level. With an odd count the first
+    // pulse has that level again, a separator keeps them apart.
+    if (tx_n & 1) {
+      tx_gap = 1;
+      tx_next(RF_RAW_MIN_PULSE, tx_first);
+      return;
+    }
+    idx = 0;
+  }
+  tx_idx = idx;
+  tx_next(tx_pulse(idx), tx_next_level(idx));
+}
+
+static void tx_start (rf_mod_t mod, uint8_t first, uint8_t loops)
+{
+  uint8_t i;
+
+  if (tx_n == 0 || loops == 0)
+    return;
+
+  // Nothing else drives the radio or the bus meanwhile
+  rf_stop_all();
+  tx_idx = 0;
+  tx_loops = loops;
+  tx_first = first;
+  tx_gap = 0;
+
+  // Pulses the compare ISR can't keep up with are stretched, count them
+  tx_short = 0;
+  for (i = 0; i < tx_n; i++) {
+    if (tx_pulses[(tx_base + i) & tx_mask] < RF_RAW_MIN_PULSE)
+      tx_short++;
+  }
+
+  // GPIO2 becomes TX data input, modulate straight from it
+  rf_spi_write(0x0d, 0x10);
+  rf_set_mod_src(mod, SRC_DIR_GPIO);
+
+  // Force OC1A to the first level before the pin is driven
+  TCCR1B = 0;
+  TCCR1A = first ? OC1A_SET : OC1A_CLEAR;
+  TCCR1C = (1 << FOC1A);
+  OUTPUT(rf_gpio);
+
+  // First edge at end of pulse 0, Timer1 clk/8 = 1us
+  TCNT1 = 0;
+  OCR1A = tx_pulse(0);
+  TCCR1A = tx_next_level(0) ? OC1A_SET : OC1A_CLEAR;
+  TIFR1 = (1 << OCF1A);
+  TIMSK1 = (1 << OCIE1A);
+  tx_active = 1;
+
+  // Radio irq would hold off the compare reload, it stays latched
+  tx_pcie = PCICR & (1 << PCIE0);
+  PCICR &= ~(1 << PCIE0);
+
+  // Turn on tx and start the clock
+  tx_radio = 1;
+  rf_spi_write(0x7, 0x9);
+  TCCR1B = (1 << CS11);
+  sei();
+}
+
+void rf_raw_replay (rf_mod_t mod, const uint16_t *pulses, uint8_t n,
+		    uint8_t first_level, uint8_t loops)
+{
+  tx_pulses = pulses;
+  tx_base = 0;
+  tx_mask = 0xff;
+  tx_n = n;
+  tx_start(mod, first_level, loops);
+}
+
+void rf_raw_replay_capture (rf_mod_t mod, uint8_t loops)
+{
+  tx_pulses = rf_raw_buf;
+  tx_base = rf_raw_tail;
+  tx_mask = RF_RAW_BUF_SZ - 1;
+  tx_n = rf_raw_avail();
+  tx_start(mod, first_level, loops);
+}
+
+void rf_raw_replay_stop (void)
+{
+  uint8_t sreg;
+
+  sreg = SREG;
+  cli();
+  if (tx_active)
+    tx_finish();
+  SREG = sreg;
+
+  // Not from the compare ISR, it could cut into a main context transfer
+  if (!tx_radio)
+    return;
+  tx_radio = 0;
+  rf_spi_write(0x7, 0x1);
+  rf_spi_write(0x0d, 0x14);
+}
+
+uint8_t rf_raw_replay_clamped (void)
+{
+  return tx_short;
+}
@@ -0,0 +1,110 @@
+#ifndef _RF_RAW_H_
+#define _RF_RAW_H_
+/*
+ * Raw pulse capture on rf_gpio (Si4432 GPIO2 = RX data).
+ * Every edge is timestamped against Timer1 free running at 1us and the
+ * length of the level that just ended goes into a ring of 16-bit
+ * durations. Gaps longer than 65ms saturate at 0xFFFF. EVENT_RF_RAW_DATA
+ * (data = pulses available) is posted every RF_RAW_EVT_PULSES pulses.
+ *
+ * PB5 has no input capture unit so the pin change ISR shared with the
+ * radio irq takes the timestamp. The 32u4 has a single pin change bank,
+ * so capture can't get a vector of its own. The edge path is inlined
+ * from here, but PCINT0 also calls into the radio irq path, so its
+ * prologue saves every call-clobbered register. Estimated, not measured:
+ * about 40 cycles from the edge to the TCNT1 sample and about 130 cycles
+ * (~16us at 8MHz) per edge in total. Pulses shorter than that can merge.
+ *
+ * The timestamp is late by whatever ISR is running when the edge comes
+ * in, so a pulse is off by up to the longest ISR on each end: the
+ * Timer0 tick with its callbacks, the USB irq and, unless held off, the
+ * display refresh byte irq (~190 cycles). Tens of us worst case, a few
+ * us typical. Callers hold the display in sync refresh during capture,
+ * see ssd1306::setsync().
+ *
+ * Replay drives the same pin as TX data input in direct mode. PB5 is also
+ * OC1A so edges come straight from the Timer1 compare output, the ISR only
+ * loads the next compare value. Between loops the pin toggles, with a
+ * RF_RAW_MIN_PULSE separator when the pulse count is odd (first and last
+ * pulse have the same level), so loops never merge. After the last loop
+ * the pin goes low and EVENT_RF_RAW_TX_DONE is posted. The radio is still
+ * in TX then, the handler calls rf_raw_replay_stop() to put it back to
+ * ready (rf_stop_all() does too).
+ */
+#include <stdint.h>
+#include <avr/io.h>
+
+#include "system.h"
+#include "evt_handler.h"
+#include "si4432.h"
+
+#define RF_RAW_BUF_SZ      128   // power of 2
+#define RF_RAW_EVT_PULSES  16    // power of 2
+// Shortest replayed pulse, us. The compare ISR must reload OCR1A within one
+// pulse. Replay stops the radio engines and masks PCINT0, what is left
+// (USB, timetick callbacks, display refresh) stays well below this. A late
+// reload stretches the pulse instead of waiting out a timer wrap. Shorter
+// pulses are sent as RF_RAW_MIN_PULSE, rf_raw_replay_clamped() counts them.
+#define RF_RAW_MIN_PULSE   100
+
+void rf_raw_capture_start (void);
+void rf_raw_capture_stop (void);
+uint8_t rf_raw_avail (void);
+uint8_t rf_raw_read (uint16_t *buf, uint8_t sz);
+uint16_t rf_raw_overflows (void);
+uint8_t rf_raw_first_level (void);
+// Timebase stamp of capture start, edge k is at start + sum(pulse[0..k])
+uint32_t rf_raw_start_us (void);
+
+// Replay n pulses (us) starting at first_level, loops times over
+void rf_raw_replay (rf_mod_t mod, const uint16_t *pulses, uint8_t n,
+		    uint8_t first_level, uint8_t loops);
+// Replay what is in the capture ring without consuming it
+void rf_raw_replay_capture (rf_mod_t mod, uint8_t loops);
+// Stop a replay and put the radio back to ready, main context only
+void rf_raw_replay_stop (void);
+// Pulses of the last replay lengthened to RF_RAW_MIN_PULSE
+uint8_t rf_raw_replay_clamped (void);
+
+// Capture state, only for the inline edge handler below
+extern volatile uint8_t rf_raw_active;
+extern volatile uint8_t rf_raw_head;
+extern volatile uint8_t rf_raw_tail;
+extern volatile uint8_t rf_raw_wraps;
+extern volatile uint16_t rf_raw_last;
+extern volatile uint16_t rf_raw_ovf;
+extern uint16_t rf_raw_buf[RF_RAW_BUF_SZ];
+
+// Called first thing from PCINT0 for every rf_gpio edge
+static inline void rf_raw_edge (void)
+{
+  uint16_t now = TCNT1;
+  uint16_t dt;
+  uint8_t wraps, head;
+
+  // Overflow pending but not yet serviced, account for it here
+  wraps = rf_raw_wraps;
+  if ((TIFR1 & (1 << TOV1)) && !(now & 0x8000)) {
+    TIFR1 = (1 << TOV1);
+    wraps++;
+  }
+
+  dt = now - rf_raw_last;
+  if (wraps > 1 || (wraps && (now >= rf_raw_last)))
+    dt = 0xffff;
+  rf_raw_last = now;
+  rf_raw_wraps = 0;
+
+  head = rf_raw_head;
+  if (((head + 1) & (RF_RAW_BUF_SZ - 1)) == rf_raw_tail) {
+    rf_raw_ovf++;
+    return;
+  }
+  rf_raw_buf[head] = dt;
+  rf_raw_head = head = (head + 1) & (RF_RAW_BUF_SZ - 1);
+
+  if ((head & (RF_RAW_EVT_PULSES - 1)) == 0)
+    evt_handler_event(EVENT_RF_RAW_DATA, rf_raw_avail());
+}
+
+#endif /* _RF_RAW_H_ */
@@ -9,23 +9,32 @@
 #include "rf_test.h"
 #include "context.h"
 #include "si4432.h"
+#include "rf_raw.h"
+#include "pkt_codec.h"
+#include "usb_serial.h"
 #include "hw.h"
 
-typedef struct {
-  uint8_t addr;
-  uint8_t val;
-} rf_reg;
-
 static context_t *sys;
 
-static void print (uint8_t line, char *fmt, uint8_t data)
+// Bytes captured by the rx engine since rx was started
+static uint16_t rx_total;
+static uint32_t last_pkt_us;
+
+static void print (uint8_t line, char *fmt, uint16_t data)
 {
   char str[21];
   
   snprintf(str, sizeof(str), fmt, data);
   sys->disp->clearline(line);
   sys->disp->drawstring (line, 0, str, 0);
-  sys->disp->display();
+  sys->disp->commit();
+}
+
+// Stop the radio, the display goes back to irq refresh
+static void stop_all (void)
+{
+  rf_stop_all();
+  sys->disp->setsync(0);
 }
 
 // Handle all events except back key to quit
@@ -48,6 +57,7 @@ uint8_t rf_event_notify (uint8_t event, uint16_t data)
       //sys->menu->SetLineStartEnd(1, 5);
       // Move this into rf driver
       //HIGH(rf_sdn);
+      stop_all();
       HIGH(led);
       return true;
       break;
@@ -55,21 +65,55 @@ uint8_t rf_event_notify (uint8_t event, uint16_t data)
       // Ignore these events
     case EVENT_VBATT:
     case EVENT_KEYPRESS:
+    case EVENT_DISP_DONE:
       //print (6, "keycode=%02x", data);
       break;
 
       // RF events
-    case EVENT_ISR_FIFO_RXHI:
-      print (7, "RX fifo hi", 0);
+    case EVENT_RF_RX_DATA: {
+      uint8_t buf[32];
+      uint8_t n;
+
+      // Drain the ring, nothing consumes the data yet
+      while ((n = rf_rx_read(buf, sizeof(buf))) != 0)
+	rx_total += n;
+      print (7, "RX %u bytes", rx_total);
+      break;
+    }
+    case EVENT_RF_SCAN_HIT:
+      print (7, "Active ch %u", data);
       break;
-    case ISR_SYNC_DET:
-      print (7, "SYNC det", 0);
+    case EVENT_RF_SWEEP_DONE: {
+      rf_sweep_frame_t *f = rf_sweep_frame(data);
+
+      // Stream frame to host, the sweep gets it back once sent. Drop it
+      // if usb is behind.
+      if (!ser.write((uint8_t *)f, RF_SWEEP_FRAME_SZ(f), &rf_sweep_release))
+	rf_sweep_release();
       break;
-    case ISR_VAL_PRM_DET:
-      print (7, "PREAMBLE det", 0);
+    }
+    case EVENT_RF_RAW_DATA:
+      // Leave pulses in the ring
+      print (7, "%u pulses", data);
       break;
-    case ISR_PKT_RCVD:
-      print (7, "PKT received", 0);
+    case EVENT_RF_RAW_TX_DONE:
+      rf_raw_replay_stop();
+      print (7, "Replay done, %u short", rf_raw_replay_clamped());
+      break;
+    case EVENT_RF_TX_DONE:
+      print (6, "TX Done %u bytes", data);
+      break;
+    case EVENT_RF_IRQ:
+      if (data & ISR_PKT_RCVD) {
+	// Gap since the previous packet, ms
+	uint32_t t = rf_irq_time();
+	print (7, "PKT +%ums", (uint16_t)((t - last_pkt_us) / 1000));
+	last_pkt_us = t;
+      }
+      else if (data & ISR_SYNC_DET)
+	print (7, "SYNC det", 0);
+      else if (data & ISR_VAL_PRM_DET)
+	print (7, "PREAMBLE det", 0);
       break;
     
     default:
@@ -83,7 +127,9 @@ uint8_t rf_event_notify (uint8_t event, uint16_t data)
 
 void unmod_carrier_315 (void)
 {
-  rf_set_freq(315.0);
+  stop_all();
+
+  rf_set_freq_khz(315000);
 
   // no modulation
   rf_spi_write(0x71, 0);
@@ -95,7 +141,9 @@ void unmod_carrier_315 (void)
 
 void unmod_carrier_434 (void)
 {
-  rf_set_freq(434.0);
+  stop_all();
+
+  rf_set_freq_khz(434000);
 
   // no modulation
   rf_spi_write(0x71, 0x0);
@@ -108,66 +156,66 @@ void unmod_carrier_434 (void)
 void unmod_carrier_off (void)
 {
   // Turn on tx off
-  rf_spi_write(0x7, 0x1);
+  stop_all();
 }
 
 void keeloq_315_tx (void)
 {
-  uint8_t i;
-  uint8_t fifo[32];
-  
+  uint8_t len;
+  static uint8_t fifo[64];  // owned by the radio until EVENT_RF_TX_DONE
+  pkt_codec_t codec;
+  // 28(serial) + 32(ci) + 4(fn) + 2(chksum), lsb first
+  static const uint8_t payload[9] = {
+    0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x55, 0xaa, 0x02
+  };
+
+  // One fifo bit per keeloq chip
+  if (rf_tx_busy() || !pkt_codec_init (&codec, &keeloq_format, 1))
+    return;
+  len = pkt_encode (&codec, payload, fifo, sizeof(fifo));
+  if (!len)
+    return;
+  stop_all();
+
   // Setup packet handling
   rf_spi_write(0x32, 0);    // no broadcast check, no header check
   rf_spi_write(0x33, 0xa);  // hdr len=0, fixpktlen=1, synclen=2
   rf_spi_write(0x34, 0x5);  // preamble - 3 nibbles = 12 bits
   rf_spi_write(0x36, 0xff); // sync words
   rf_spi_write(0x37, 0x00); 
-  rf_spi_write(0x3e, 32);    // packet length
 
-  // data rate = 64kbps
-  rf_spi_write (0x6e, 0x10);
-  rf_spi_write (0x6f, 0x62);
-  rf_spi_write (0x58, 0x80); //according to datasheet < 100kbps
+  // chip rate from the packet format
+  rf_set_tx_rate_bps (pkt_codec_bps (&codec));
 
   // Set tx power to +20dBm
   rf_set_power (RF_20_DBM);
 
   // Manchester disable
-  rf_spi_write(0x70, 0x00);
+  rf_reg_update(0x70, 0x0f, 0);
+  rf_reg_flush();
 
   // Setup modulation
   //rf_set_mod_src(MOD_OOK, SRC_FIFO);
   rf_spi_write(0x71, 0x21);
 
   // Tune to 315 Mhz
-  //rf_set_freq(315.0);
+  //rf_set_freq_khz(315000);
   rf_spi_write(0x75, 0x47);  // Frequency band select
   rf_spi_write(0x76, 0x7D);  // Nominal carrier freq 1
   rf_spi_write(0x77, 0x00);  // Nominal carrier freq 0
 
-  // Fill in fifo
-  for (i = 0; i < 32; i++) {
-    fifo[i] = 2;
-  }
-
-  // Write fifo to radio
-  rf_fifo_write (fifo, sizeof(fifo));
-
-  // Turn on tx_on
-  rf_spi_write(0x7, 0x9);
-
-  // Wait for packet to complete
-  while (rf_spi_read(7) & 0x8);
-  print (6, "TX Done", 0);
-  _delay_ms(500);
-  print (6, "       ", 0);
+  // Packet length, FIFO load and tx_on, completion comes as an event
+  rf_tx_start (fifo, len);
+  print (6, "TX...", 0);
 }
 
 void keeloq_315_rx (void)
 {
   uint8_t i;
   uint8_t fifo[32];
-  
+
+  stop_all();
+
   // Setup packet handling
   rf_spi_write(0x30, 0xd);  // disable packet handling
   rf_spi_write(0x32, 0);    // no broadcast check, no header check
@@ -197,7 +245,7 @@ void keeloq_315_rx (void)
   rf_spi_write(0x71, 0x21);
 
   // Tune to 315 Mhz
-  rf_set_freq(315.0);
+  rf_set_freq_khz(315000);
 
   // Setup IF bandwidth = 142.8kHz
   rf_spi_write(0x1c, 0x94);
@@ -226,7 +274,7 @@ void keeloq_315_rx (void)
   rf_spi_write(0x7, 0x4);
 }
 
-rf_reg rx_regs[] = {
+static const rf_reg_t rx_regs[] PROGMEM = {
   {0x1C, 0x81},  // IF filter bw
   {0x1D, 0x3C},  // AFC Loop Gearshift Override
   {0x1E, 0x02},  // AFC timing control
@@ -264,30 +312,53 @@ rf_reg rx_regs[] = {
 
 void rx_315(void)
 {
-  uint8_t i;
+  // Nothing may touch the bus while the table goes out
+  stop_all();
 
   // Write to si4432
-  for (i = 0; i < sizeof(rx_regs)/sizeof(rx_regs[0]); i++) {
-    rf_spi_write(rx_regs[i].addr, rx_regs[i].val);
-  }
+  rf_apply_regs_P(rx_regs, sizeof(rx_regs)/sizeof(rx_regs[0]));
 
-  // Clear rx fifo
-  rf_spi_write(0x8, 0x2);
-  // Set rx threshold
-  rf_spi_write(0x7e, 0x23);
-  
-  // Enable interrupts
-  rf_spi_write(0x5, 0x92);
-  rf_spi_write(0x6, 0xC0);
-  PCMSK0 |= (1 << 4);
-  PCICR = 1;
-  sei();
-  
-  // Turn on reciever
-  rf_spi_write(0x7, 0x4);
+  // Stream FIFO into the rx ring
+  rx_total = 0;
+  rf_rx_start();
 }
 
 
+// Look for preamble on the 315 plan, 5ms per channel
+void scan_315(void)
+{
+  stop_all();
+  rf_apply_regs_P(rx_regs, sizeof(rx_regs)/sizeof(rx_regs[0]));
+  rf_scan_start(314000000UL, 25, RF_PLAN_315_CNT, 5000);
+}
+
+// RSSI sweep 430-440MHz in 100kHz bins, 300us settle = ~30ms per pass
+// so a frame is always sent before it gets refilled
+void sweep_433(void)
+{
+  stop_all();
+  rf_apply_regs_P(rx_regs, sizeof(rx_regs)/sizeof(rx_regs[0]));
+  rf_sweep_start(430000000UL, 440000000UL, 10, 300);
+}
+
+// Record raw OOK edges at 315MHz
+void raw_315(void)
+{
+  stop_all();
+  rf_apply_regs_P(rx_regs, sizeof(rx_regs)/sizeof(rx_regs[0]));
+  // Display refresh irq would delay the edge timestamps
+  sys->disp->setsync(1);
+  rf_raw_capture_start();
+}
+
+// Send the captured pulses back out 3 times, +20dBm
+void replay_315(void)
+{
+  stop_all();
+  rf_set_power(RF_20_DBM);
+  rf_raw_replay_capture(MOD_OOK, 3);
+}
+
 /* Menu Entrys */
 MenuEntry m_rf_root[] = {
   MenuEntry("Keeloq TX", &keeloq_315_tx),
@@ -295,7 +366,11 @@ MenuEntry m_rf_root[] = {
   MenuEntry("Carrier 434", &unmod_carrier_434),
   MenuEntry("Carrier Off", &unmod_carrier_off),
   
-  //MenuEntry("RX @ 315", &rx_315),
+  MenuEntry("RX @ 315", &rx_315),
+  MenuEntry("Scan 315", &scan_315),
+  MenuEntry("Spectrum 433", &sweep_433),
+  MenuEntry("Raw capture 315", &raw_315),
+  MenuEntry("Raw replay", &replay_315),
   //MenuEntry("RX buffer", &dump_rx_fifo),
   NULL
 };
@@ -0,0 +1,105 @@
+#ifndef _RING_H_
+#define _RING_H_
+/**
+ * Fixed size rings for passing data out of interrupts.
+ *
+ * Ring - single producer, single consumer. Lock free, the producer only
+ * writes head and the consumer only writes tail. Both are 8 bit so AVR
+ * loads and stores are atomic.
+ *
+ * MpRing - any number of producers (several ISRs and the main loop), one
+ * consumer. push() masks interrupts for the few cycles it takes.
+ *
+ * Size must be a power of two no larger than 128. Indices run free and
+ * are masked on access, so all N slots are usable.
+ **/
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+// Keep the compiler from moving slot accesses across index updates
+#define RING_BARRIER()  __asm__ __volatile__ ("" ::: "memory")
+
+template <typename T, uint8_t N>
+class Ring {
+ public:
+  Ring(void) : head(0), tail(0), hwm(0), drops(0) {}
+
+  // Producer side, returns 0 and counts a drop when full
+  uint8_t push(const T &v) {
+    uint8_t h = head;
+    uint8_t used = (uint8_t)(h - tail);
+
+    if (used >= N) {
+      drops++;
+      return 0;
+    }
+    buf[h & (N - 1)] = v;
+    RING_BARRIER();
+    head = h + 1;
+    if (++used > hwm)
+      hwm = used;
+    return 1;
+  }
+
+  // Consumer side, returns 0 when empty
+  uint8_t pop(T &v) {
+    uint8_t t = tail;
+
+    if (t == head)
+      return 0;
+    v = buf[t & (N - 1)];
+    RING_BARRIER();
+    tail = t + 1;
+    return 1;
+  }
+
+  uint8_t count(void) const { return (uint8_t)(head - tail); }
+  uint8_t empty(void) const { return head == tail; }
+
+  // Statistics, drop count is 16 bit so read it with irqs off
+  uint8_t high_water(void) const { return hwm; }
+  uint16_t dropped(void) const {
+    uint16_t d;
+    uint8_t sreg = SREG;
+
+    cli();
+    d = drops;
+    SREG = sreg;
+    return d;
+  }
+  void clear_stats(void) {
+    uint8_t sreg = SREG;
+
+    cli();
+    hwm = count();
+    drops = 0;
+    SREG = sreg;
+  }
+
+ protected:
+  // Compile time size check, fails on non power of two
+  typedef char size_check[((N & (N - 1)) == 0 && N <= 128) ? 1 : -1];
+
+  T buf[N];
+  volatile uint8_t head;   // written by producer
+  volatile uint8_t tail;   // written by consumer
+  volatile uint8_t hwm;
+  volatile uint16_t drops;
+};
+
+template <typename T, uint8_t N>
+class MpRing : public Ring<T, N> {
+ public:
+  uint8_t push(const T &v) {
+    uint8_t ret;
+    uint8_t sreg = SREG;
+
+    cli();
+    ret = Ring<T, N>::push(v);
+    SREG = sreg;
+    return ret;
+  }
+};
+
+#endif /* _RING_H_ */
@@ -4,10 +4,15 @@
  *
  * Elliot Buller 2012
  */
+#include <string.h>
+
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
 #include "si4432.h"
+#include "rf_raw.h"
+#include "timebase.h"
+#include "prof.h"
 #include "evt_handler.h"
 #include "system.h"
 #include "hw.h"
@@ -17,74 +22,236 @@
 #define SPI_BAUD_1p3MHZ  2
 #define SPI_BAUD_1MHZ    3
 
-// Spi access functions
-static inline void _spi_write(uint8_t data)
+/*
+ * Register shadow cache. Write-through copy of the register file so config
+ * changes don't need an SPI read before every write. rf_reg_set() only marks
+ * changed registers dirty and rf_reg_flush() pushes dirty runs as bursts.
+ */
+#define RF_NUM_REGS  0x80
+#define REG_BIT(a)   (1 << ((a) & 7))
+
+static uint8_t shadow[RF_NUM_REGS];
+static uint8_t dirty[RF_NUM_REGS / 8];
+
+// Status, readback and strobe registers that always go to the radio
+static const uint8_t volatile_map[RF_NUM_REGS / 8] PROGMEM = {
+  0x9C,  // 0x02-0x04 status/isr, 0x07 op control 1 (tx/rx self clear)
+  0x01,  // 0x08 op control 2 (fifo clear strobes)
+  0x02,  // 0x11 adc value
+  0x00,
+  0x40,  // 0x26 rssi
+  0x0B,  // 0x28/0x29 antenna diversity, 0x2B afc readback
+  0x02,  // 0x31 ezmac status
+  0x00,
+  0x80,  // 0x47 received header 3
+  0x0F,  // 0x48-0x4A received header 2-0, 0x4B received pkt len
+  0x00, 0x00, 0x00, 0x00, 0x00,
+  0x80,  // 0x7F fifo
+};
+
+static inline uint8_t rf_reg_volatile (uint8_t addr)
 {
-  uint8_t dummy;
-  /* Wait for empty transmit buffer */
-  while ( !( UCSR1A & (1<<UDRE1)) );
-  UDR1 = data;
-    /* Wait for transmit to complete */
-  while ( !( UCSR1A & (1<<TXC1)) );
-  /* Wait for data to be received */
-  while ( !(UCSR1A & (1<<RXC1)) );
-  // Throw byte away
-  dummy = UDR1;
+  return pgm_read_byte(&volatile_map[addr >> 3]) & REG_BIT(addr);
 }
 
-// Spi access functions
-static inline uint8_t _spi_read(uint8_t data)
+// Copy a burst into the shadow, radio auto increments until the fifo
+static void rf_shadow_store (uint8_t addr, const uint8_t *buf, uint8_t sz)
 {
-  uint8_t d;
-  /* Wait for empty transmit buffer */
-  while ( !( UCSR1A & (1<<UDRE1)) );
-  UDR1 = data;
-    /* Wait for transmit to complete */
-  while ( !( UCSR1A & (1<<TXC1)) );
-  /* Wait for data to be received */
-  while ( !(UCSR1A & (1<<RXC1)) );
-  // Return byte
-  d = UDR1;
-  return d;
+  for (; sz && (addr < RF_NUM_REGS - 1); sz--, addr++, buf++) {
+    if (rf_reg_volatile(addr))
+      continue;
+    shadow[addr] = *buf;
+    dirty[addr >> 3] &= ~REG_BIT(addr);
+  }
 }
 
-void rf_spi_writem (uint8_t addr, uint8_t *buf, uint8_t sz)
+/*
+ * Async transfer state. The RX complete irq moves one byte per irq and
+ * keeps a second one queued in the transmit buffer.
+ */
+static uint8_t * volatile spi_in;
+static const uint8_t * volatile spi_out;
+static volatile uint8_t spi_tx_left;  // bytes still to queue
+static volatile uint16_t spi_rx_left; // bytes still to receive, sz + 1
+static volatile uint8_t spi_skip;     // address byte echo pending
+static volatile uint8_t spi_busy;
+static volatile uint8_t spi_sync;     // _spi_block owns the bus
+static uint8_t spi_wr;
+static rf_spi_cb_t spi_cb;
+
+// Move one byte of the async transfer, irqs off
+static void rf_spi_async_step (void)
 {
-  uint8_t i;
+  uint8_t d = UDR1;
+
+  if (spi_skip)
+    spi_skip = 0;
+  else if (!spi_wr)
+    *spi_in++ = d;
 
-  // Asset cs
+  if (spi_tx_left) {
+    spi_tx_left--;
+    UDR1 = spi_wr ? *spi_out++ : 0;
+  }
+
+  if (--spi_rx_left)
+    return;
+
+  // Done
+  HIGH(rf_cs);
+  UCSR1B &= ~(1<<RXCIE1);
+  spi_busy = 0;
+  if (spi_cb)
+    spi_cb();
+}
+
+// Finish a running async transfer before touching the bus
+static void rf_spi_wait (void)
+{
+  uint8_t sreg;
+
+  while (spi_busy) {
+    sreg = SREG;
+    cli();
+    if (spi_busy && (UCSR1A & (1<<RXC1)))
+      rf_spi_async_step();
+    SREG = sreg;
+  }
+}
+
+/*
+ * Pipelined block transfer. MSPIM has a double buffered transmitter and a
+ * two byte receive FIFO, so up to two bytes are kept in flight and the bus
+ * never idles between bytes. Either out or in may be NULL.
+ */
+static void _spi_block (uint8_t addr, const uint8_t *out, uint8_t *in,
+			uint8_t sz)
+{
+  uint8_t tx_left = sz;
+  uint16_t rx_left = sz + 1;   // address echo too, 256 for a full burst
+  uint8_t d, sreg, lock, prev;
+
+  // Claim the bus, an irq may start an async transfer until we do
+  for (;;) {
+    rf_spi_wait();
+    sreg = SREG;
+    cli();
+    if (!spi_busy)
+      break;
+    SREG = sreg;
+  }
+  prev = spi_sync;
+  spi_sync = 1;
+
+  // Hop timer and radio irq use the bus too, hold them off. A no-op
+  // from inside their own ISRs.
+  lock = (TIMSK4 & (1<<TOIE4)) | (PCICR & (1<<PCIE0));
+  TIMSK4 &= ~(1<<TOIE4);
+  PCICR &= ~(1<<PCIE0);
+  SREG = sreg;
+
+  // Assert cs, address goes first and its echo is dropped
   HIGH(rf_cs);
   LOW(rf_cs);
-  /* Write address */
-  _spi_write(addr | 0x80);
-  
-  // Send all data
-  for (i = 0; i < sz; i++) {
-    _spi_write(*buf);
-    buf++;
+  UDR1 = addr;
+
+  while (rx_left) {
+    if (tx_left && ((uint8_t)(rx_left - tx_left) < 2) &&
+	(UCSR1A & (1<<UDRE1))) {
+      UDR1 = out ? *out++ : 0;
+      tx_left--;
+    }
+    if (UCSR1A & (1<<RXC1)) {
+      d = UDR1;
+      if (in && (rx_left <= sz))
+	*in++ = d;
+      rx_left--;
+    }
   }
+
   // De-assert cs
   HIGH(rf_cs);
+
+  sreg = SREG;
+  cli();
+  TIMSK4 |= lock & (1<<TOIE4);
+  PCICR |= lock & (1<<PCIE0);
+  spi_sync = prev;
+  SREG = sreg;
+}
+
+void rf_spi_writem (uint8_t addr, uint8_t *buf, uint8_t sz)
+{
+  // Write-through, fifo writes don't touch the shadow
+  if (addr != 0x7f)
+    rf_shadow_store(addr, buf, sz);
+
+  _spi_block(addr | 0x80, buf, NULL, sz);
 }
 
 void rf_spi_readm (uint8_t addr, uint8_t *buf, uint8_t sz)
 {
-  uint8_t i;
+  uint8_t *start = buf;
 
-  // Assert cs
-  HIGH(rf_cs);
-  LOW(rf_cs);
-  // Write address
-  _spi_write(addr & 0x7f);
-  
-  // Loop through all bytes to receives
-  for (i = 0; i < sz; i++) {
-    // Send dummy byte to generate clock
-    *buf = _spi_read (0);
-    buf++;
+  _spi_block(addr & 0x7f, NULL, buf, sz);
+
+  // Refresh shadow, but keep pending writes
+  for (addr &= 0x7f; sz && (addr < RF_NUM_REGS - 1); sz--, addr++, start++) {
+    if (!rf_reg_volatile(addr) && !(dirty[addr >> 3] & REG_BIT(addr)))
+      shadow[addr] = *start;
   }
-  // De-assert cs
+}
+
+uint8_t rf_spi_async (uint8_t addr, uint8_t *buf, uint8_t sz, rf_spi_cb_t cb)
+{
+  uint8_t sreg;
+
+  if (!sz)
+    return 0;
+
+  sreg = SREG;
+  cli();
+  if (spi_busy || spi_sync) {
+    SREG = sreg;
+    return 0;
+  }
+
+  // Register writes still go through the shadow
+  spi_wr = addr & 0x80;
+  if (spi_wr && ((addr & 0x7f) != 0x7f))
+    rf_shadow_store(addr & 0x7f, buf, sz);
+
+  spi_in = buf;
+  spi_out = buf;
+  spi_cb = cb;
+  spi_skip = 1;
+  spi_rx_left = sz + 1;
+  spi_busy = 1;
+
+  // Address plus first byte fill the transmit buffers
   HIGH(rf_cs);
+  LOW(rf_cs);
+  while (!(UCSR1A & (1<<UDRE1)))
+    ;
+  UDR1 = addr;
+  while (!(UCSR1A & (1<<UDRE1)))
+    ;
+  UDR1 = spi_wr ? *spi_out++ : 0;
+  spi_tx_left = sz - 1;
+
+  UCSR1B |= (1<<RXCIE1);
+  SREG = sreg;
+  return 1;
+}
+
+uint8_t rf_spi_async_busy (void)
+{
+  return spi_busy;
+}
+
+ISR(USART1_RX_vect)
+{
+  rf_spi_async_step();
 }
 
 void rf_spi_write (uint8_t addr, uint8_t data)
@@ -99,6 +266,113 @@ uint8_t rf_spi_read (uint8_t addr)
   return d;
 }
 
+// Cached register access
+uint8_t rf_reg_get (uint8_t addr)
+{
+  if (addr >= RF_NUM_REGS || rf_reg_volatile(addr))
+    return rf_spi_read(addr);
+  return shadow[addr];
+}
+
+void rf_reg_set (uint8_t addr, uint8_t val)
+{
+  uint8_t sreg;
+
+  if (addr >= RF_NUM_REGS)
+    return;
+
+  // Bypass cache
+  if (rf_reg_volatile(addr)) {
+    rf_spi_write(addr, val);
+    return;
+  }
+
+  // Only changed registers get pushed, the ISRs flush too
+  sreg = SREG;
+  cli();
+  if (shadow[addr] != val) {
+    shadow[addr] = val;
+    dirty[addr >> 3] |= REG_BIT(addr);
+  }
+  SREG = sreg;
+}
+
+void rf_reg_update (uint8_t addr, uint8_t mask, uint8_t val)
+{
+  uint8_t sreg = SREG;
+
+  cli();
+  rf_reg_set(addr, (rf_reg_get(addr) & ~mask) | (val & mask));
+  SREG = sreg;
+}
+
+// Push all dirty registers, consecutive ones in a single burst. Atomic so
+// an ISR flush can't split a run or see it half cleared.
+void rf_reg_flush (void)
+{
+  uint8_t addr = 0, start;
+  uint8_t sreg = SREG;
+
+  cli();
+  while (addr < RF_NUM_REGS) {
+    // Skip clean groups of 8
+    if (dirty[addr >> 3] == 0) {
+      addr += 8;
+      continue;
+    }
+    if (!(dirty[addr >> 3] & REG_BIT(addr))) {
+      addr++;
+      continue;
+    }
+    for (start = addr; (addr < RF_NUM_REGS) &&
+	   (dirty[addr >> 3] & REG_BIT(addr)); addr++);
+    rf_spi_writem(start, &shadow[start], addr - start);
+  }
+  SREG = sreg;
+}
+
+// Longest run sent in one burst
+#define RF_BURST_MAX  16
+
+static void rf_apply (const rf_reg_t *tbl, uint8_t cnt, uint8_t pgm)
+{
+  uint8_t buf[RF_BURST_MAX];
+  uint8_t i, n = 0, start = 0, addr, val;
+
+  for (i = 0; i < cnt; i++, tbl++) {
+    addr = pgm ? pgm_read_byte(&tbl->addr) : tbl->addr;
+    val  = pgm ? pgm_read_byte(&tbl->val)  : tbl->val;
+
+    // Send current run once it breaks or fills up
+    if (n && ((addr != start + n) || (n == sizeof(buf)))) {
+      rf_spi_writem(start, buf, n);
+      n = 0;
+    }
+    if (n == 0)
+      start = addr;
+    buf[n++] = val;
+  }
+  if (n)
+    rf_spi_writem(start, buf, n);
+}
+
+void rf_apply_regs (const rf_reg_t *tbl, uint8_t cnt)
+{
+  rf_apply(tbl, cnt, 0);
+}
+
+void rf_apply_regs_P (const rf_reg_t *tbl, uint8_t cnt)
+{
+  rf_apply(tbl, cnt, 1);
+}
+
+// Reload shadow from the radio, drops pending writes
+static void rf_reg_sync (void)
+{
+  memset(dirty, 0, sizeof(dirty));
+  rf_spi_readm(0, shadow, RF_NUM_REGS - 1);
+}
+
 /* Initialize MSPIM */
 static void rf_spi_init(uint16_t baud)
 {
@@ -156,6 +430,9 @@ uint8_t rf_probe(void)
   // Wait until interrupt is asserted
   while (READ(rf_irq));
 
+  // Registers are back at their reset values
+  rf_reg_sync();
+
   // Setup gpio tx/rx switch selects
   rf_spi_write(0x0b, 0x92);  //gpio0=tx_state
   rf_spi_write(0x0c, 0x95);  //gpio1=rx_state
@@ -182,73 +459,118 @@ void rf_set_mode (rf_mode_t mode)
 // Generic RF
 void rf_set_freq (float freq_mhz)
 {
-  uint8_t hbsel;
-  uint16_t fb, fc;
+  rf_set_freq_hz((uint32_t)(freq_mhz * 1000000.0));
+}
+
+// Integer only, no soft float on the retune path
+void rf_set_freq_hz (uint32_t hz)
+{
+  uint8_t hbsel, fb, sreg;
+  uint32_t unit, rem;
+  uint16_t fc;
 
-  if (freq_mhz < 240.0 || freq_mhz > 960.0)
+  if (hz < 240000000UL || hz > 960000000UL)
     return;
 
   // Are we in the high band or low band?
-  hbsel = (freq_mhz >= 480.0) ? 1 : 0;
-  
-  // Calculate fb[4:0]
-  fb = hbsel ? (uint16_t)(freq_mhz/2) : (uint16_t)freq_mhz;
-  fb = (fb - 240) / 10;
+  hbsel = (hz >= 480000000UL) ? 1 : 0;
+  unit = 10000000UL << hbsel;
+
+  // Calculate fb[4:0], at most 23 subtractions beats a 32-bit divide
+  rem = hz - 24 * unit;
+  for (fb = 0; rem >= unit; fb++)
+    rem -= unit;
+
+  // Calculate fc[15:0] = rem * 64000 / unit, rounded
+  fc = (uint16_t)((rem * (4 >> hbsel) + 312) / 625);
+
+  // Retune lands as one flush
+  sreg = SREG;
+  cli();
 
   // clear frequency offset
-  rf_spi_write(0x73, 0);
-  rf_spi_write(0x74, 0);
+  rf_reg_set(0x73, 0);
+  rf_reg_set(0x74, 0);
 
-  // Program band select
-  rf_spi_write(0x75, (uint8_t)fb | (hbsel << 5));
+  // Program band select, keep sideband select
+  rf_reg_update(0x75, 0x3f, fb | (hbsel << 5));
 
-  // Calculate fc[15:0]
-  fc = (uint16_t)(((freq_mhz/((float)10 * (hbsel + 1))) 
-		   - fb - 24) * (float)64000);
   // Program nominal carrier
-  rf_spi_writem(0x76, (uint8_t *)&fc, 2);
+  rf_reg_set(0x76, fc >> 8);
+  rf_reg_set(0x77, fc & 0xff);
 
   // No freq hopping
-  rf_spi_write(0x79, 0);
+  rf_reg_set(0x79, 0);
+  rf_reg_flush();
+  SREG = sreg;
+}
+
+// Channel plans
+const rf_chan_t rf_plan_315[RF_PLAN_315_CNT] PROGMEM = {
+  RF_PLAN8(314000000UL, 250000UL)
+};
+const rf_chan_t rf_plan_433[RF_PLAN_433_CNT] PROGMEM = {
+  RF_PLAN8(433100000UL, 200000UL)
+};
+const rf_chan_t rf_plan_868[RF_PLAN_868_CNT] PROGMEM = {
+  RF_PLAN8(868100000UL, 250000UL)
+};
+const rf_chan_t rf_plan_915[RF_PLAN_915_CNT] PROGMEM = {
+  RF_PLAN16(902200000UL, 1600000UL)
+};
+
+void rf_set_chan (const rf_chan_t *plan, uint8_t chan)
+{
+  rf_chan_t c;
+
+  memcpy_P(&c, &plan[chan], sizeof(c));
+  rf_spi_writem(0x75, c.reg, sizeof(c.reg));
 }
 
 
 void rf_set_mod_src (rf_mod_t mod, rf_src_t src)
 {
-  uint8_t tmp;
   if (mod >= MOD_MAX || src >= SRC_MAX)
     return;
   
-  tmp = rf_spi_read(0x71);
-  tmp &= ~0x33;
-  tmp = (src << 4) | mod;
-  rf_spi_write(0x71, tmp);
+  rf_reg_update(0x71, 0x33, (src << 4) | mod);
+  rf_reg_flush();
 }
 
 // RF TX control
 void rf_set_tx_rate (uint16_t rate_kbps)
 {
-  uint8_t scale, tmp;
+  if (rate_kbps > 1000)
+    return;
+
+  rf_set_tx_rate_bps((uint32_t)rate_kbps * 1000);
+}
+
+void rf_set_tx_rate_bps (uint32_t bps)
+{
+  uint8_t scale, sreg;
   uint16_t dr;
 
-  if (rate_kbps > 1000)
+  if (bps > 1000000UL)
     return;
-  
-  // calc reg value
-  scale = (rate_kbps <= 31) ? 1 : 0;
+
+  // txdr = bps * 2^(16 + 5 * scale) / 1MHz, scale while it fits 16 bits
+  scale = (bps <= 31249UL) ? 1 : 0;
   if (scale)
-    dr = (uint16_t)(rate_kbps * 2097.152f);
+    dr = (uint16_t)((bps * 65536UL) / 31250UL);
   else
-    dr = (uint16_t)(rate_kbps * 65.536f);
+    dr = (uint16_t)((bps * 4096UL) / 62500UL);
 
   // Program data rate
-  rf_spi_writem(0x6e, (uint8_t *)&dr, 2);
+  sreg = SREG;
+  cli();
+  rf_reg_set(0x6e, dr >> 8);
+  rf_reg_set(0x6f, dr & 0xff);
 
   // program scale flag
-  tmp = rf_spi_read(0x70);
-  tmp &= ~(1 << 5);
-  tmp |= (scale << 5);
-  rf_spi_write(0x70, tmp);
+  rf_reg_update(0x70, 1 << 5, scale << 5);
+  rf_reg_flush();
+  SREG = sreg;
 }
 
 void rf_set_power (rf_power_t pwr)
@@ -256,7 +578,8 @@ void rf_set_power (rf_power_t pwr)
   if (pwr >= RF_MAX_DBM)
     return;
 
-  rf_spi_write (0x6d, pwr);
+  rf_reg_set (0x6d, pwr);
+  rf_reg_flush();
 }
 
 // FIFO access
@@ -270,67 +593,633 @@ void rf_fifo_read(uint8_t *buf, uint8_t sz)
 }
 
 // ISR control fuctions
+// Status/enable regs pair up as {reg5, reg6} = {mask >> 8, mask & 0xff}
 void rf_enable_isr(uint16_t mask)
 {
-  uint16_t tmp;
-  rf_spi_readm(5, (uint8_t *)&tmp, 2);
-  tmp |= mask;
-  rf_spi_writem(5, (uint8_t *)&tmp, 2);
+  uint8_t sreg = SREG;
+
+  cli();
+  rf_reg_update(5, mask >> 8, 0xff);
+  rf_reg_update(6, mask & 0xff, 0xff);
+  rf_reg_flush();
+  SREG = sreg;
 
   // Setup PCINT4 for ISR
   PCMSK0 |= (1 << 4);
-  PCICR = 1;
+  PCICR |= (1 << PCIE0);
   sei();
 }
 
 void rf_disable_isr(uint16_t mask)
 {
-  uint16_t tmp;
-  rf_spi_readm(5, (uint8_t *)&tmp, 2);
-  tmp &= ~mask;
-  rf_spi_writem(5, (uint8_t *)&tmp, 2);
+  uint8_t sreg = SREG;
+
+  cli();
+  rf_reg_update(5, mask >> 8, 0);
+  rf_reg_update(6, mask & 0xff, 0);
+  rf_reg_flush();
+
+  // Pin stays armed while other irqs are enabled. PCICR is left alone,
+  // raw capture shares PCINT0.
+  if (!rf_reg_get(5) && !rf_reg_get(6))
+    PCMSK0 &= ~(1 << 4);
+  SREG = sreg;
+}
+
+/*
+ * RX streaming engine
+ */
+#define RF_RX_ISRS  (ISR_FIFO_RXHI | ISR_FIFO_UNDOVR | ISR_PKT_RCVD)
+
+// RX ring doubles as sweep frame storage, the modes are exclusive
+static union {
+  uint8_t rx[RF_RX_BUF_SZ];
+  rf_sweep_frame_t sweep[2];
+} mode_buf;
+#define rx_buf  mode_buf.rx
+
+static volatile uint8_t rx_head;     // written by ISR
+static volatile uint8_t rx_tail;     // written by reader
+static volatile uint8_t rx_active;
+static volatile uint8_t rx_evt_pending;
+static volatile uint16_t rx_dropped;
+static uint8_t rx_pkt_got;           // bytes of the current packet read
+static uint8_t rx_pkt_lost;          // FIFO cleared mid packet
+static volatile uint16_t rx_len_err; // length below what was read
+
+static void rf_rx_clear_fifo (void)
+{
+  rf_spi_write(0x08, 2);
+  rf_spi_write(0x08, 0);
+}
+
+// Move want FIFO bytes into the ring, ISR context. What doesn't fit is
+// cleared and the rest of that packet is lost.
+static void rf_rx_drain (uint8_t want)
+{
+  uint8_t n, room, head;
+  uint16_t first;
+
+  // One slot is kept empty to tell full from empty
+  head = rx_head;
+  room = (RF_RX_BUF_SZ - 1) - (uint8_t)(head - rx_tail);
+  n = (room < want) ? room : want;
+
+  // Burst read, split in two where the ring wraps
+  first = RF_RX_BUF_SZ - head;
+  if (first > n)
+    first = n;
+  if (first)
+    rf_spi_readm(0x7f, &rx_buf[head], first);
+  if (n > first)
+    rf_spi_readm(0x7f, rx_buf, n - first);
+  rx_head = head + n;
+  rx_pkt_got += n;
+
+  // Ring full, throw away what is left in the FIFO
+  if (n < want) {
+    rf_rx_clear_fifo();
+    rx_dropped++;
+    rx_pkt_lost = 1;
+  }
+}
+
+// Packet valid, the tail of it sits below the watermark
+static void rf_rx_pkt_end (void)
+{
+  uint8_t len;
+
+  if (rx_pkt_lost)
+    rf_rx_clear_fifo();
+  else {
+    // A bad length byte can be below what the watermark drains took
+    len = rf_spi_read(0x4b);
+    if (len > rx_pkt_got)
+      rf_rx_drain(len - rx_pkt_got);
+    else if (len < rx_pkt_got) {
+      rf_rx_clear_fifo();
+      rx_len_err++;
+    }
+  }
+  rx_pkt_got = 0;
+  rx_pkt_lost = 0;
+}
+
+// Read out what is left below the watermark one byte at a time until
+// the FIFO underflows. Radio irq must be held off, it clears the flag.
+static uint8_t rf_rx_tail (void)
+{
+  uint8_t i, d, head, got = 0;
+
+  rf_spi_read(3);
+  for (i = 0; i < 64; i++) {
+    d = rf_spi_read(0x7f);
+    if (rf_spi_read(3) & (ISR_FIFO_UNDOVR >> 8))
+      break;
+    head = rx_head;
+    if ((uint8_t)(head + 1) == rx_tail) {
+      rx_dropped++;
+      break;
+    }
+    rx_buf[head] = d;
+    rx_head = head + 1;
+    got++;
+  }
+  rf_rx_clear_fifo();
+  return got;
+}
+
+void rf_rx_start(void)
+{
+  // Ring storage is shared with the sweep
+  rf_sweep_stop();
+
+  rx_head = rx_tail = 0;
+  rx_dropped = 0;
+  rx_len_err = 0;
+  rx_evt_pending = 0;
+  rx_pkt_got = 0;
+  rx_pkt_lost = 0;
+
+  // Set rx threshold and start from an empty FIFO
+  rf_spi_write(0x7e, RF_RX_THRESH);
+  rf_rx_clear_fifo();
+
+  rx_active = 1;
+  rf_enable_isr(RF_RX_ISRS);
+
+  // Turn on reciever
+  rf_spi_write(0x7, 0x4);
+}
+
+void rf_rx_stop(void)
+{
+  uint8_t sreg, pcie;
+
+  if (!rx_active)
+    return;
+
+  rx_active = 0;
+  rf_disable_isr(RF_RX_ISRS);
+
+  // Back to ready mode, the FIFO keeps its contents
+  rf_spi_write(0x7, 0x1);
+
+  // Pick up the partial chunk, a pending radio irq stays latched
+  sreg = SREG;
+  cli();
+  pcie = PCICR & (1 << PCIE0);
+  PCICR &= ~(1 << PCIE0);
+  SREG = sreg;
+  if (rf_rx_tail() && !rx_evt_pending) {
+    rx_evt_pending = 1;
+    evt_handler_event(EVENT_RF_RX_DATA, rf_rx_avail());
+  }
+  PCICR |= pcie;
+}
+
+uint16_t rf_rx_avail(void)
+{
+  return (uint8_t)(rx_head - rx_tail);
+}
+
+uint16_t rf_rx_read(uint8_t *buf, uint16_t sz)
+{
+  uint16_t n = 0;
+  uint8_t tail = rx_tail;
+
+  // Re-arm the event first so data arriving from here on gets reported
+  rx_evt_pending = 0;
+
+  while ((n < sz) && (tail != rx_head))
+    buf[n++] = rx_buf[tail++];
+  rx_tail = tail;
+
+  return n;
+}
+
+// Number of times data was lost (ring full or FIFO over/underflow)
+uint16_t rf_rx_dropped(void)
+{
+  uint16_t d;
+  uint8_t sreg = SREG;
+
+  cli();
+  d = rx_dropped;
+  SREG = sreg;
+  return d;
+}
+
+// Packets whose length register was below the bytes already read
+uint16_t rf_rx_len_errors(void)
+{
+  uint16_t d;
+  uint8_t sreg = SREG;
+
+  cli();
+  d = rx_len_err;
+  SREG = sreg;
+  return d;
+}
+
+/*
+ * TX pipeline
+ */
+#define RF_TX_ISRS  (ISR_FIFO_TXLO | ISR_PKT_SENT | ISR_FIFO_UNDOVR)
+
+static const uint8_t *tx_buf;
+static volatile uint16_t tx_len;    // bytes left to load
+static uint16_t tx_total;
+static volatile uint8_t tx_active;
+static uint8_t tx_stream;           // packet handler turned off
+static uint8_t tx_pkctrl;           // reg 0x30 before a stream send
+
+static void rf_tx_clear_fifo (void)
+{
+  rf_spi_write(0x08, 1);
+  rf_spi_write(0x08, 0);
+}
+
+// Push the next chunk into the FIFO, ISR context or before tx_on
+static void rf_tx_load (uint8_t max)
+{
+  uint8_t n = (tx_len < max) ? tx_len : max;
+
+  rf_spi_writem(0x7f, (uint8_t *)tx_buf, n);
+  tx_buf += n;
+  tx_len -= n;
+
+  // Nothing left, only completion irqs are needed
+  if (!tx_len)
+    rf_disable_isr(ISR_FIFO_TXLO);
+}
+
+static void rf_tx_finish (void)
+{
+  tx_active = 0;
+  rf_disable_isr(RF_TX_ISRS);
+  if (tx_stream)
+    rf_spi_write(0x30, tx_pkctrl);
+  evt_handler_event(EVENT_RF_TX_DONE, tx_total - tx_len);
+}
+
+uint8_t rf_tx_start(const uint8_t *buf, uint16_t len)
+{
+  if (tx_active || !len)
+    return 0;
+
+  // Radio is half duplex
+  rf_rx_stop();
+  rf_sweep_stop();
+
+  tx_buf = buf;
+  tx_len = tx_total = len;
+
+  // Short buffers are one packet, otherwise stream until the FIFO runs dry
+  tx_stream = (len > 255);
+  if (tx_stream) {
+    tx_pkctrl = rf_reg_get(0x30);
+    rf_spi_write(0x30, tx_pkctrl & ~0x08);
+  }
+  else
+    rf_spi_write(0x3e, len);
+
+  rf_spi_write(0x7d, RF_TX_THRESH);
+  rf_tx_clear_fifo();
+  rf_tx_load(64);
+
+  tx_active = 1;
+  rf_enable_isr(tx_len ? RF_TX_ISRS : (ISR_PKT_SENT | ISR_FIFO_UNDOVR));
+
+  // Turn on transmitter
+  rf_spi_write(0x7, 0x9);
+  return 1;
+}
+
+void rf_tx_abort(void)
+{
+  if (!tx_active)
+    return;
+
+  // Back to ready mode
+  rf_spi_write(0x7, 0x1);
+  rf_tx_clear_fifo();
+  rf_tx_finish();
+}
+
+uint8_t rf_tx_busy(void)
+{
+  return tx_active;
+}
+
+/*
+ * Channel scanner and RSSI sweep share the hop engine
+ */
+#define HOP_OFF       0
+#define HOP_PREAMBLE  1   // scanner, poll latched preamble per channel
+#define HOP_RSSI      2   // sweep, sample rssi per channel
+
+static uint8_t scan_hits[256 / 8];
+static volatile uint8_t scan_chan;
+static uint8_t scan_nchan;
+static uint8_t hop_mode;
+
+// Sweep frames ping-pong, index of the one being filled. The other one
+// is locked while it is handed over, a pass that ends meanwhile is dropped.
+static uint8_t sweep_cur;
+static uint8_t sweep_seq;
+static volatile uint8_t sweep_locked;
+static volatile uint16_t sweep_drops;
+
+// Run Timer4 with TOP = OCR4C, overflow every us. Picks the smallest
+// prescaler (CS4 = n gives clk/2^(n-1)) that fits in 8 bits.
+static void rf_timer4_start (uint16_t us)
+{
+  uint32_t t = (uint32_t)us * (F_CPU / 1000000UL);
+  uint8_t cs = 1;
+
+  while ((t > 255) && (cs < 15)) {
+    t >>= 1;
+    cs++;
+  }
+  if (t > 255)
+    t = 255;
+
+  TCCR4B = 0;
+  TCCR4A = 0;
+  TCCR4C = 0;
+  TCCR4D = 0;            // normal mode, TOP = OCR4C
+  TC4H = 0;
+  OCR4C = t ? t : 1;
+  TC4H = 0;
+  TCNT4 = 0;
+  TIFR4 = (1 << TOV4);
+  TIMSK4 = (1 << TOIE4);
+  TCCR4B = cs;
+  sei();
+}
+
+static void rf_timer4_stop (void)
+{
+  TCCR4B = 0;
+  TIMSK4 = 0;
+}
+
+// Program base + step once, rf_set_freq_hz() also selects channel 0
+static void rf_hop_start (uint8_t mode, uint32_t base_hz, uint8_t step_10khz,
+			  uint8_t nchan, uint16_t dwell_us)
+{
+  scan_nchan = nchan;
+  scan_chan = 0;
+  rf_set_freq_hz(base_hz);
+  rf_reg_set(0x7a, step_10khz);
+  rf_reg_flush();
+
+  // Turn on reciever and start dwelling
+  hop_mode = mode;
+  rf_spi_write(0x7, 0x5);
+  rf_timer4_start(dwell_us);
+}
 
+static void rf_hop_stop (void)
+{
+  rf_timer4_stop();
+  hop_mode = HOP_OFF;
+  rf_reg_set(0x79, 0);
+  rf_reg_flush();
+
+  // Back to ready mode
+  rf_spi_write(0x7, 0x1);
+}
+
+void rf_scan_start (uint32_t base_hz, uint8_t step_10khz, uint8_t nchan,
+		    uint16_t dwell_us)
+{
+  uint8_t sreg;
+
+  if (nchan == 0)
+    return;
+
+  rf_stop_all();
+  memset(scan_hits, 0, sizeof(scan_hits));
+
+  // Latch valid preamble in status but poll it instead of taking PCINT,
+  // nothing else stays enabled
   PCMSK0 &= ~(1 << 4);
-  PCICR = 0;
-}
-
-// Map irqs to events
-static const uint8_t rf_irq_evt[] = {
-  EVENT_ISR_FIFO_UNDOVR,
-  EVENT_ISR_FIFO_TXHI,
-  EVENT_ISR_FIFO_TXLO,
-  EVENT_ISR_FIFO_RXHI,
-  EVENT_ISR_EXT_INTEN,
-  EVENT_ISR_PKT_SENT,
-  EVENT_ISR_PKT_RCVD,
-  EVENT_ISR_CRC_ERR,
-  EVENT_ISR_SYNC_DET,
-  EVENT_ISR_VAL_PRM_DET,
-  EVENT_ISR_INV_PRM_DET,
-  EVENT_ISR_RSSI,
-  EVENT_ISR_WAKE_TMR,
-  EVENT_ISR_LOW_BATT,
-  EVENT_ISR_XTAL_RDY,
-  EVENT_ISR_POR_EN,
-};
+  sreg = SREG;
+  cli();
+  rf_reg_set(5, 0);
+  rf_reg_set(6, ISR_VAL_PRM_DET);
+  rf_reg_flush();
+  SREG = sreg;
+  rf_spi_read(3);
+  rf_spi_read(4);
 
+  rf_hop_start(HOP_PREAMBLE, base_hz, step_10khz, nchan, dwell_us);
+}
 
-/* RF IRQ interrupt */
-ISR(PCINT0_vect)
+void rf_scan_stop (void)
+{
+  if (hop_mode != HOP_PREAMBLE)
+    return;
+
+  rf_hop_stop();
+  rf_reg_update(6, ISR_VAL_PRM_DET, 0);
+  rf_reg_flush();
+
+  // Release nIRQ, a latched preamble would hide the next edge
+  rf_spi_read(3);
+  rf_spi_read(4);
+}
+
+uint8_t rf_scan_hit (uint8_t chan)
+{
+  return scan_hits[chan >> 3] & (1 << (chan & 7));
+}
+
+// Sweep range must stay inside one band, hops can't change hbsel
+void rf_sweep_start (uint32_t start_hz, uint32_t stop_hz, uint8_t step_10khz,
+		     uint16_t settle_us)
+{
+  uint32_t n;
+  uint8_t i;
+
+  if (step_10khz == 0 || stop_hz < start_hz)
+    return;
+
+  // Sweep frames live in the rx ring, rx streaming can't run meanwhile.
+  // Samples are polled, no radio irq either.
+  rf_stop_all();
+  rf_disable_isr(0xffff);
+
+  n = (stop_hz - start_hz) / (step_10khz * 10000UL) + 1;
+  if (n > RF_SWEEP_MAX_BINS)
+    n = RF_SWEEP_MAX_BINS;
+
+  for (i = 0; i < 2; i++) {
+    mode_buf.sweep[i].sync[0] = RF_SWEEP_SYNC0;
+    mode_buf.sweep[i].sync[1] = RF_SWEEP_SYNC1;
+    mode_buf.sweep[i].nbins = n;
+    mode_buf.sweep[i].step_10khz = step_10khz;
+    mode_buf.sweep[i].start_khz = start_hz / 1000;
+  }
+  sweep_cur = 0;
+  sweep_seq = 0;
+  sweep_locked = 0;
+  sweep_drops = 0;
+
+  rf_hop_start(HOP_RSSI, start_hz, step_10khz, n, settle_us);
+}
+
+void rf_sweep_stop (void)
+{
+  if (hop_mode == HOP_RSSI)
+    rf_hop_stop();
+}
+
+rf_sweep_frame_t *rf_sweep_frame (uint8_t idx)
+{
+  return &mode_buf.sweep[idx & 1];
+}
+
+void rf_sweep_release (void)
+{
+  sweep_locked = 0;
+}
+
+uint16_t rf_sweep_dropped (void)
+{
+  uint16_t d;
+  uint8_t sreg = SREG;
+
+  cli();
+  d = sweep_drops;
+  SREG = sreg;
+  return d;
+}
+
+// End of dwell, sample the channel then hop
+ISR(TIMER4_OVF_vect)
+{
+  uint8_t chan = scan_chan;
+
+  if (hop_mode == HOP_RSSI) {
+    rf_sweep_frame_t *f = &mode_buf.sweep[sweep_cur];
+
+    f->bin[chan] = rf_spi_read(0x26);
+
+    // Pass complete, hand frame over and fill the other one. If that
+    // is still out, drop this pass and refill, seq shows the gap.
+    if (chan == scan_nchan - 1) {
+      f->seq = sweep_seq++;
+      if (sweep_locked ||
+	  !evt_handler_event(EVENT_RF_SWEEP_DONE, sweep_cur))
+	sweep_drops++;
+      else {
+	sweep_locked = 1;
+	sweep_cur ^= 1;
+      }
+    }
+  }
+  else if (rf_spi_read(4) & ISR_VAL_PRM_DET) {
+    scan_hits[chan >> 3] |= (1 << (chan & 7));
+    evt_handler_event(EVENT_RF_SCAN_HIT, chan);
+  }
+
+  // One SPI write per hop
+  if (++chan >= scan_nchan)
+    chan = 0;
+  rf_spi_write(0x79, chan);
+  scan_chan = chan;
+}
+
+void rf_stop_all (void)
+{
+  rf_tx_abort();
+  rf_rx_stop();
+  rf_scan_stop();
+  rf_sweep_stop();
+  rf_raw_capture_stop();
+  rf_raw_replay_stop();
+
+  // Also ends a manual tx/rx_on
+  rf_spi_write(0x7, 0x1);
+}
+
+static volatile uint32_t irq_us;
+
+uint32_t rf_irq_time(void)
 {
-  uint8_t i, s3, s4;
+  uint32_t t;
+  uint8_t sreg = SREG;
+
+  cli();
+  t = irq_us;
+  SREG = sreg;
+  return t;
+}
+
+/* RF IRQ service, the vector below wraps it for profiling */
+static inline void rf_irq (void)
+{
+  uint8_t s[2];
   uint16_t irq;
 
+  irq_us = timebase_us_isr();
+
   // Make sure RF_IRQ is low
   //if (!READ(rf_irq)) {
     // Read RF irq events
-    rf_spi_readm(3, (uint8_t *)&irq, 2);
-    // Generate async event for each rf irq
-    for (i = 0; irq && (i < 16); i++) {
-      if (irq & 0x8000) {
-	evt_handler_event(rf_irq_evt[i], 0);
-	irq <<= 1;
+    rf_spi_readm(3, s, 2);
+    irq = ((uint16_t)s[0] << 8) | s[1];
+
+    // RX engine consumes its own irqs and posts a single event
+    if (rx_active) {
+      if (irq & ISR_FIFO_UNDOVR) {
+	rf_rx_clear_fifo();
+	rx_dropped++;
+	rx_pkt_lost = 1;
       }
-    }// end for
+      else if (irq & ISR_FIFO_RXHI)
+	rf_rx_drain(RF_RX_THRESH);
+      if (irq & ISR_PKT_RCVD)
+	rf_rx_pkt_end();
+      if ((irq & (ISR_FIFO_RXHI | ISR_PKT_RCVD)) && !rx_evt_pending) {
+	rx_evt_pending = 1;
+	evt_handler_event(EVENT_RF_RX_DATA, rf_rx_avail());
+      }
+      // Packet valid still goes out as EVENT_RF_IRQ
+      irq &= ~(ISR_FIFO_UNDOVR | ISR_FIFO_RXHI);
+    }
+
+    // TX pipeline, an underflow ends a stream or kills a late refill
+    if (tx_active) {
+      if ((irq & ISR_FIFO_TXLO) && tx_len)
+	rf_tx_load(RF_TX_REFILL);
+      if (irq & (ISR_PKT_SENT | ISR_FIFO_UNDOVR)) {
+	rf_spi_write(0x7, 0x1);
+	rf_tx_finish();
+      }
+      irq &= ~RF_TX_ISRS;
+    }
+
+    // Whatever is left and enabled goes out as one event
+    irq &= ((uint16_t)rf_reg_get(5) << 8) | rf_reg_get(6);
+    if (irq)
+      evt_handler_event(EVENT_RF_IRQ, irq);
     //}// end if
 }
+
+/* RF IRQ interrupt */
+ISR(PCINT0_vect)
+{
+  // Raw capture owns the vector, timestamp the edge before anything else
+  if (rf_raw_active) {
+    rf_raw_edge();
+    return;
+  }
+
+  PROF_ENTER();
+  rf_irq();
+  PROF_EXIT(PROF_RF_IRQ);
+}
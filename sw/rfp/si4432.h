@@ -67,14 +67,80 @@ void rf_spi_readm (uint8_t addr, uint8_t *buf, uint8_t sz);
 void rf_spi_write (uint8_t addr, uint8_t data);
 void rf_spi_writem (uint8_t addr, uint8_t *buf, uint8_t sz);
 
+// Interrupt driven transfer, addr bit 7 set for writes. Returns 0 if the
+// bus is busy, also when called from an irq that cut into a blocking
+// transfer. cb runs in irq context, or in whoever next blocks on the
+// bus if it gets there first. Reads don't refresh the register shadow.
+typedef void (*rf_spi_cb_t)(void);
+uint8_t rf_spi_async (uint8_t addr, uint8_t *buf, uint8_t sz, rf_spi_cb_t cb);
+uint8_t rf_spi_async_busy (void);
+
+// Cached register access. rf_reg_set/update only touch the shadow copy,
+// rf_reg_flush pushes changed registers. Status regs always hit the radio.
+// Each call is atomic, the ISRs use the cache too. Sets that must reach the
+// radio together go between SREG save/cli and restore, ending in a flush.
+uint8_t rf_reg_get (uint8_t addr);
+void rf_reg_set (uint8_t addr, uint8_t val);
+void rf_reg_update (uint8_t addr, uint8_t mask, uint8_t val);
+void rf_reg_flush (void);
+
+// Register table entry
+typedef struct {
+  uint8_t addr;
+  uint8_t val;
+} rf_reg_t;
+
+// Apply a table sorted by address, consecutive registers go out in one
+// burst. _P variant takes a table stored in PROGMEM.
+void rf_apply_regs (const rf_reg_t *tbl, uint8_t cnt);
+void rf_apply_regs_P (const rf_reg_t *tbl, uint8_t cnt);
+
 // Generic RF
 void rf_set_freq (float freq_mhz);
+void rf_set_freq_hz (uint32_t freq_hz);
+#define rf_set_freq_khz(khz)  rf_set_freq_hz((uint32_t)(khz) * 1000UL)
 void rf_set_mod_src (rf_mod_t mod, rf_src_t src);
 
 // RF TX control
 void rf_set_tx_rate (uint16_t rate_kbps);
+void rf_set_tx_rate_bps (uint32_t rate_bps);
 void rf_set_power (rf_power_t power);
 
+/*
+ * Channel plans. f = 10MHz * (hbsel + 1) * (fb + 24 + fc / 64000)
+ * The macros below fold to constants so plan tables are built by the
+ * compiler and a channel hop is one 3 byte burst to regs 0x75-0x77.
+ */
+typedef struct {
+  uint8_t reg[3];   // 0x75 band select, 0x76/0x77 nominal carrier
+} rf_chan_t;
+
+#define RF_HBSEL(hz)    ((hz) >= 480000000UL ? 1 : 0)
+#define RF_UNIT(hz)     (10000000UL << RF_HBSEL(hz))
+#define RF_FB(hz)       ((hz) / RF_UNIT(hz) - 24)
+#define RF_FC(hz)       ((((hz) - (RF_FB(hz) + 24) * RF_UNIT(hz)) *	\
+			  (4 >> RF_HBSEL(hz)) + 312) / 625)
+#define RF_CHAN(hz)     {{ 0x40 | (RF_HBSEL(hz) << 5) | RF_FB(hz),	\
+			   (RF_FC(hz) >> 8) & 0xff, RF_FC(hz) & 0xff }}
+
+#define RF_PLAN4(hz, sp)  RF_CHAN(hz), RF_CHAN((hz) + (sp)),		\
+			  RF_CHAN((hz) + 2 * (sp)), RF_CHAN((hz) + 3 * (sp))
+#define RF_PLAN8(hz, sp)  RF_PLAN4(hz, sp), RF_PLAN4((hz) + 4 * (sp), sp)
+#define RF_PLAN16(hz, sp) RF_PLAN8(hz, sp), RF_PLAN8((hz) + 8 * (sp), sp)
+
+// Predefined ISM band plans (PROGMEM)
+#define RF_PLAN_315_CNT  8    // 314.000 MHz + n * 250kHz
+#define RF_PLAN_433_CNT  8    // 433.100 MHz + n * 200kHz
+#define RF_PLAN_868_CNT  8    // 868.100 MHz + n * 250kHz
+#define RF_PLAN_915_CNT  16   // 902.200 MHz + n * 1.6MHz
+extern const rf_chan_t rf_plan_315[RF_PLAN_315_CNT];
+extern const rf_chan_t rf_plan_433[RF_PLAN_433_CNT];
+extern const rf_chan_t rf_plan_868[RF_PLAN_868_CNT];
+extern const rf_chan_t rf_plan_915[RF_PLAN_915_CNT];
+
+// Tune to entry in a PROGMEM channel plan
+void rf_set_chan (const rf_chan_t *plan, uint8_t chan);
+
 // FIFO access
 void rf_fifo_write(uint8_t *buf, uint8_t sz);
 void rf_fifo_read(uint8_t *buf, uint8_t sz);
@@ -101,12 +167,99 @@ void rf_fifo_read(uint8_t *buf, uint8_t sz);
 // Mask for all valid
 #define ISR_MASK_ALL     0xFFFA  // remove por and low battery
 
-// Enable disable ISRs
+// Enable disable ISRs. Enabled irqs not consumed by the driver engines
+// are posted as one EVENT_RF_IRQ with the status mask as data.
 void rf_enable_isr(uint16_t mask);
 void rf_disable_isr(uint16_t mask);
 
+// Timebase stamp (us) of the last radio irq, read it when handling
+// EVENT_RF_IRQ, EVENT_RF_RX_DATA or EVENT_RF_TX_DONE
+uint32_t rf_irq_time(void);
+
+/*
+ * RX streaming engine. The ISR drains the radio FIFO into an SRAM ring
+ * every time the RX almost full watermark is crossed and posts a single
+ * EVENT_RF_RX_DATA (data = bytes available) until the ring is read again.
+ * The part below the watermark is read on packet valid (length from 0x4B)
+ * and, until the FIFO runs empty, on rf_rx_stop.
+ */
+#define RF_RX_BUF_SZ     256   // ring size, uint8_t indices wrap for free
+#define RF_RX_THRESH     48    // FIFO almost full watermark (of 64)
+
+void rf_rx_start(void);
+void rf_rx_stop(void);
+uint16_t rf_rx_avail(void);
+uint16_t rf_rx_read(uint8_t *buf, uint16_t sz);
+uint16_t rf_rx_dropped(void);
+uint16_t rf_rx_len_errors(void);
+
+/*
+ * TX pipeline. rf_tx_start preloads the FIFO, turns on the transmitter and
+ * returns. The ISR refills the FIFO from buf on the TX almost empty irq and
+ * posts EVENT_RF_TX_DONE (data = bytes sent) once the radio is done. buf
+ * must stay untouched until then. Up to 255 bytes go out as one packet
+ * using the current packet handler setup (reg 0x3e is set to len), longer
+ * buffers are streamed with the TX packet handler off.
+ */
+#define RF_TX_THRESH     16    // FIFO almost empty watermark (of 64)
+#define RF_TX_REFILL     (64 - RF_TX_THRESH - 1)
+
+uint8_t rf_tx_start(const uint8_t *buf, uint16_t len);
+void rf_tx_abort(void);
+uint8_t rf_tx_busy(void);
+
+/*
+ * Channel scanner. Base frequency and hop step are programmed once, each
+ * hop only rewrites reg 0x79. Timer4 times the dwell on every channel and
+ * a valid preamble latched during the dwell marks the channel active and
+ * posts EVENT_RF_SCAN_HIT (data = channel). The modem (data rate, preamble
+ * threshold) must already be configured. Radio irqs are not available to
+ * other users while scanning.
+ */
+void rf_scan_start (uint32_t base_hz, uint8_t step_10khz, uint8_t nchan,
+		    uint16_t dwell_us);
+void rf_scan_stop (void);
+uint8_t rf_scan_hit (uint8_t chan);
+
+/*
+ * RSSI sweep. Hops start..stop like the scanner and samples reg 0x26 after
+ * settling on each step. Every full pass posts EVENT_RF_SWEEP_DONE with the
+ * index of a frame ready to go out as is, rf_sweep_frame() gets it. Frames
+ * ping-pong, the one handed over stays locked until rf_sweep_release().
+ * Passes that end while it is locked are dropped and counted. Shares
+ * storage with the rx ring and stops rx streaming.
+ */
+#define RF_SWEEP_SYNC0     0xA5
+#define RF_SWEEP_SYNC1     0x5A
+#define RF_SWEEP_MAX_BINS  119  // two frames fill the rx ring
+
+typedef struct {
+  uint8_t  sync[2];      // RF_SWEEP_SYNC0, RF_SWEEP_SYNC1
+  uint8_t  seq;          // pass counter
+  uint8_t  nbins;        // valid bins
+  uint8_t  step_10khz;   // bin spacing
+  uint32_t start_khz;    // bin 0 frequency, little endian
+  uint8_t  bin[RF_SWEEP_MAX_BINS];  // raw rssi
+} rf_sweep_frame_t;
+
+#define RF_SWEEP_FRAME_SZ(f)  (sizeof(rf_sweep_frame_t) - RF_SWEEP_MAX_BINS + \
+			       (f)->nbins)
+
+void rf_sweep_start (uint32_t start_hz, uint32_t stop_hz, uint8_t step_10khz,
+		     uint16_t settle_us);
+void rf_sweep_stop (void);
+rf_sweep_frame_t *rf_sweep_frame (uint8_t idx);
+void rf_sweep_release (void);
+uint16_t rf_sweep_dropped (void);
+
+// Stop rx, tx, scan, sweep and raw capture/replay, radio back to ready.
+// Call before reconfiguring, the engines' ISRs use the bus.
+void rf_stop_all (void);
+
 typedef enum {
   ENCODE_KEELOQ_PCM,  // keeloq pulse coded modulation
+  ENCODE_MANCHESTER,  // 1 = 10, 0 = 01
+  ENCODE_NRZ,         // 1 = 1, 0 = 0
   ENCODE_MAX
 } data_encode_t;
 
@@ -122,18 +275,7 @@ typedef struct {
   uint8_t data_bc;        // count of payload bits
 } packet_format_t;
 
-#if 0
-packet_format_t keeloq_format = {
-    400, // 400us bit time
-    1,   // preamble hi = 1 bit
-    2,   // preamble lo = 2 bit
-    6,   // 6 preamble bits
-    10,  // header hi = 4ms = 10 bits
-    10,  // header lo = 4ms = 10 bits
-    ENCODE_KEELOQ_PCM, // pulse coded modulation
-    66   // 66 bits = 28(serial) + 32(ci) + 4(fn) + 2(chksum)
-};
-#endif
+// Format instances live in pkt_codec.cpp
 
 /** Not to self. Use preamble detect to scan channels and
  * quickly determine if the channel is being used. */
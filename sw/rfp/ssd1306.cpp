@@ -9,12 +9,18 @@
  * Elliot Buller 2011
  **/
 
-#include <avr/pgmspace.h>
-#include <util/delay.h>
 #include <string.h>
 #include <stdlib.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#ifndef SSD1306_HOST
+#include <util/delay.h>
+#endif
 #include "ssd1306.h"
+#include "prof.h"
 #include "glcdfont.h"
+#include "evt_handler.h"
+#include "timetick.h"
 
 
 //Array to hold icons references - Non member for c callbacks
@@ -24,24 +30,24 @@ static icon_cb_t icon[LCD_MAX_ICON];
  * Draw bitmap to display. Will not cache it but instead write it directly
  * to display. Only supports native resolution of 128 x 64
  */
-void ssd1306::drawbitmap(const uint8_t *bitmap, uint8_t w, uint8_t h) {
+template <class Bus>
+void ssd1306_core<Bus>::drawbitmap(const uint8_t *bitmap, uint8_t w, uint8_t h) {
   if (w != LCD_WIDTH || h != LCD_HEIGHT)
     return;
 
-  ssd1306_command(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
-  ssd1306_command(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
-  ssd1306_command(SSD1306_SETSTARTLINE | 0x0); // line #0
+  setpages(0, LCD_CHAR_LINES - 1);
+  ssd1306_datablock_P(bitmap, 1024);
 
-  for (uint16_t i=0; i<1024; i++) {
-    ssd1306_data( pgm_read_byte(&bitmap[i]) );
-  }
+  // Screen no longer matches the character buffer
+  dirty = 0xff;
 }
 
 /**
  * Register icon with display driver. Icon must be 8 bits high and a multiple
  * if 6 bits wide. Icons can later be displayed using the drawicon fn.
  */
-void ssd1306::registericon(uint8_t index, icon_cb_t cb) {
+template <class Bus>
+void ssd1306_core<Bus>::registericon(uint8_t index, icon_cb_t cb) {
   if (index >= LCD_MAX_ICON)
     return;
   // Save cb
@@ -53,11 +59,12 @@ void ssd1306::registericon(uint8_t index, icon_cb_t cb) {
  * Place an icon into the character buffer. Will get displayed on next 
  * screen update
  */  
-void ssd1306::drawicon(uint8_t idx, uint8_t line, uint8_t x, uint8_t width) {
+template <class Bus>
+void ssd1306_core<Bus>::drawicon(uint8_t idx, uint8_t line, uint8_t x, uint8_t width) {
   uint8_t i;
 
-  // Check bounds on x
-  if (x >= LCD_CHAR_PER_LINE)
+  // Check bounds on x and line
+  if ((x >= LCD_CHAR_PER_LINE) || (line >= LCD_CHAR_LINES))
     return;
 
   // Validate icon index
@@ -75,11 +82,17 @@ void ssd1306::drawicon(uint8_t idx, uint8_t line, uint8_t x, uint8_t width) {
     // Clear invert flag
     invert_mask[x + i] &= ~(1 << line);
   }
+  dirty |= (1 << line);
 }
 
-void ssd1306::clearline(uint8_t line) {
+template <class Bus>
+void ssd1306_core<Bus>::clearline(uint8_t line) {
   uint8_t i;
+
+  if (line >= LCD_CHAR_LINES)
+    return;
   memset(&buf[line], 0, LCD_CHAR_PER_LINE);
+  dirty |= (1 << line);
 
   /* Clear all invert bits for line */
   for (i = 0; i < LCD_CHAR_PER_LINE; i++) {
@@ -90,9 +103,11 @@ void ssd1306::clearline(uint8_t line) {
 /**
  * Draw a string into the character buffer
  */
-void ssd1306::drawstring(uint8_t line, uint8_t x, const char *c, uint8_t invert) {
-  if (x >= LCD_CHAR_PER_LINE)
+template <class Bus>
+void ssd1306_core<Bus>::drawstring(uint8_t line, uint8_t x, const char *c, uint8_t invert) {
+  if ((x >= LCD_CHAR_PER_LINE) || (line >= LCD_CHAR_LINES))
     return;
+  dirty |= (1 << line);
 
   while (*c != 0) {
     buf[line][x] = *c;
@@ -113,96 +128,298 @@ void ssd1306::drawstring(uint8_t line, uint8_t x, const char *c, uint8_t invert)
 
 
 
-inline void ssd1306::spiwrite(uint8_t c) {
-  // Add spi hw access here
-  // Write byte out to SPI hardware
-  SPDR = c;
-  // Wait for transfer to complete
-  while(!(SPSR & (1<<SPIF)))
+template <class Bus>
+void ssd1306_core<Bus>::ssd1306_command(uint8_t c) { 
+  // Wait out a background refresh
+  while (refreshing)
     ;
+  bus().bus_command(c);
 }
 
-void ssd1306::ssd1306_command(uint8_t c) { 
-  LCD_CS_PORT |= _BV(LCD_CS_PIN);
-  LCD_DC_PORT &= ~_BV(LCD_DC_PIN);
-  LCD_CS_PORT &= ~_BV(LCD_CS_PIN);
-  spiwrite(c);
-  LCD_CS_PORT |= _BV(LCD_CS_PIN);
+template <class Bus>
+void ssd1306_core<Bus>::ssd1306_data(uint8_t c) {
+  data_begin();
+  bus().bus_write(c);
+  bus().bus_end();
 }
 
-void ssd1306::ssd1306_data(uint8_t c) {
-  LCD_CS_PORT |= _BV(LCD_CS_PIN);
-  LCD_DC_PORT |= _BV(LCD_DC_PIN);
-  LCD_CS_PORT &= ~_BV(LCD_CS_PIN);
-  spiwrite(c);
-  LCD_CS_PORT |= _BV(LCD_CS_PIN);
+template <class Bus>
+void ssd1306_core<Bus>::invalidate(uint8_t line) {
+  if (line < LCD_CHAR_LINES)
+    dirty |= (1 << line);
+}
+
+// Point the horizontal addressing window at pages start..end
+template <class Bus>
+void ssd1306_core<Bus>::setpages(uint8_t start, uint8_t end) {
+  ssd1306_command(SSD1306_COLUMNADDR);
+  ssd1306_command(0);
+  ssd1306_command(LCD_WIDTH - 1);
+  ssd1306_command(SSD1306_PAGEADDR);
+  ssd1306_command(start);
+  ssd1306_command(end);
+}
+
+// Data run, the bus sets CS/DC once
+template <class Bus>
+inline void ssd1306_core<Bus>::data_begin(void) {
+  while (refreshing)
+    ;
+  bus().bus_begin();
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::ssd1306_datablock(const uint8_t *buf, uint16_t len) {
+  data_begin();
+  while (len--)
+    bus().bus_write(*buf++);
+  bus().bus_end();
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::ssd1306_datablock_P(const uint8_t *buf, uint16_t len) {
+  data_begin();
+  while (len--)
+    bus().bus_write(pgm_read_byte(buf++));
+  bus().bus_end();
 }
 
 /**
- * Update the display with data in the character buffer
+ * Render 6 pixel column cell n of a line into out, returns its length.
+ * Cell 21 is the 2 blank columns that round the line out to 128.
  */
-void ssd1306::display(void) {
-  uint8_t line, idx;
+template <class Bus>
+uint8_t ssd1306_core<Bus>::rendercell(uint8_t line, uint8_t n, uint8_t *out) {
+  uint8_t c, i, icon_flag = 0;
+  const uint8_t *bm;
+
+  if (n >= LCD_CHAR_PER_LINE) {
+    if (n > LCD_CHAR_PER_LINE)
+      return 0;
+    out[0] = out[1] = 0;
+    return 2;
+  }
 
-  // Set display to raster from top left
-  ssd1306_command(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
-  ssd1306_command(SSD1306_SETHIGHCOLUMN | 0x0);  // hi col = 0
-  ssd1306_command(SSD1306_SETSTARTLINE | 0x0); // line #0
+  // grab character
+  c = buf[line][n];
+
+  // if icon do character replacement
+  if (c & LCD_ICON_FLAG) {
+    uint8_t idx;
+
+    // Check bounds on index;
+    idx = (c >> 3) & 0xf;
+    if ((idx >= LCD_MAX_ICON) || (icon[idx] == NULL))
+      bm = &font['$' * 5];
+    else {
+      // Point to icon character
+      // Call icon callback to get icon
+      bm = icon[idx](idx);
+      bm = &bm[(c & 0x7) * 6];
+      icon_flag = 1;
+    }
+  }
+  else {
+    // Point to font character
+    bm = &font[c * 5];
+  }
+
+  // Draw character
+  for (i = 0; i < 6; i++) {
+    // get each character slice
+    // ascii chars are only 5 bits wide
+    c = ((i == 5) && !icon_flag) ? 0 : pgm_read_byte(&bm[i]);
+
+    // Invert if necessary
+    if (invert_mask[n] & (1 << line))
+      c = ~c;
+    out[i] = c;
+  }
+  return 6;
+}
+
+/**
+ * Update the display with data in the character buffer. Only lines
+ * touched since the last call are sent.
+ */
+template <class Bus>
+void ssd1306_core<Bus>::display(void) {
+  uint8_t line, n, i, len;
+  uint8_t out[6];
+  PROF_ENTER();
 
-  // Loop through the character buffer
+  // Loop through the changed lines of the character buffer
   for (line = 0; line < LCD_CHAR_LINES; line++) {
-    for (idx = 0; idx < LCD_CHAR_PER_LINE; idx++) {
-      uint8_t c, i, icon_flag = 0;
-      uint8_t *bm;
-
-      // grab character
-      c  = buf[line][idx];
-
-      // if icon do character replacement
-      if (c & LCD_ICON_FLAG) {
-	uint8_t idx;
-
-	// Check bounds on index;
-	idx = (c >> 3) & 0xf;
-	if ((idx >= LCD_MAX_ICON) || (icon[idx] == NULL))
-	  bm = &font['$' * 5];
-	else {
-	  // Point to icon character
-	  // Call icon callback to get icon
-	  bm = (icon[idx] != NULL) ? icon[idx](idx) : &font['$' * 5];
-	  bm = &bm[(c & 0x7) * 6];
-	  icon_flag = 1;
-	}
-      }
-      else {
-	// Point to font character
-	bm = &font[c * 5];
-	icon_flag = 0;
-      }
-
-      // Draw character
-      for (i = 0; i < 6; i++) {
-	// get each character slice
-	// ascii chars are only 5 bits wide
-	c = ((i == 5) && !icon_flag) ? 0 : pgm_read_byte(&bm[i]);
-	
-	// Invert if necessary
-	if (invert_mask[idx] & (1 << line))
-	  c = ~c;
-
-	// Write data out to display
-	ssd1306_data(c);
-      }
+    if (!(dirty & (1 << line)))
+      continue;
+    dirty &= ~(1 << line);
+    setpages(line, line);
+
+    data_begin();
+    for (n = 0; (len = rendercell(line, n, out)) != 0; n++) {
+      for (i = 0; i < len; i++)
+	bus().bus_write(out[i]);
     }
-    // 21 chars per line * 6bytes per character = 126
-    // Need 2 null bytes to round out each line
-    ssd1306_data(0);
-    ssd1306_data(0);
+    bus().bus_end();
   }
+  PROF_EXIT(PROF_DISPLAY);
+}
+
+/**
+ * Background refresh. Each line goes out as the 6 window commands with
+ * DC low, then 22 cells with DC high. The next cell is rendered once per
+ * cell, while the first byte of the current one shifts out.
+ */
+#define PH_CMD   0
+#define PH_DATA  1
+
+static inline uint8_t page_cmd(uint8_t i, uint8_t line) {
+  switch (i) {
+    case 0: return SSD1306_COLUMNADDR;
+    case 1: return 0;
+    case 2: return LCD_WIDTH - 1;
+    case 3: return SSD1306_PAGEADDR;
+    default: return line;
+  }
+}
+
+// Kick off the next pending line, 0 if there is none
+template <class Bus>
+uint8_t ssd1306_core<Bus>::startline(void) {
+  uint8_t line;
+
+  for (line = 0; line < LCD_CHAR_LINES; line++) {
+    if (pend_lines & (1 << line))
+      break;
+  }
+  if (line == LCD_CHAR_LINES)
+    return 0;
+  pend_lines &= ~(1 << line);
+
+  cur_line = line;
+  cell_len = rendercell(line, 0, cell[front]);
+  cur_cell = 1;
+  next_len = 0;
+  byte_idx = 0;
+
+  phase = PH_CMD;
+  bus().bus_dc(0);
+  bus().bus_put(page_cmd(0, line));
+  cmd_idx = 1;
+  return 1;
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::isr_next(void) {
+  if (phase == PH_CMD) {
+    if (cmd_idx < 6) {
+      bus().bus_put(page_cmd(cmd_idx++, cur_line));
+      return;
+    }
+    bus().bus_dc(1);
+    phase = PH_DATA;
+  }
+  else if (byte_idx == cell_len) {
+    // Line done, move on or finish
+    if (!next_len) {
+      if (startline())
+	return;
+      bus().bus_async_stop();
+      refreshing = 0;
+      evt_handler_event(EVENT_DISP_DONE, 0);
+      return;
+    }
+    front ^= 1;
+    cell_len = next_len;
+    next_len = 0;
+    byte_idx = 0;
+  }
+
+  bus().bus_put(cell[front][byte_idx++]);
+  if (byte_idx == 1)
+    next_len = rendercell(cur_line, cur_cell++, cell[front ^ 1]);
+}
+
+/**
+ * Frame limited commit. Timetick runs at 100Hz, the deferred timer
+ * brings the refresh back to the main loop.
+ */
+template <class Bus>
+ssd1306_core<Bus> *ssd1306_core<Bus>::commit_disp;
+
+template <class Bus>
+void ssd1306_core<Bus>::commit_cb(uint16_t ticks) {
+  commit_disp->commit_armed = 0;
+  commit_disp->last_refresh = ticks;
+  commit_disp->refresh();
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::commit(void) {
+  uint16_t since;
+
+  if (commit_armed)
+    return;
+
+  // Frame already over, go now
+  commit_disp = this;
+  since = timetick_getcount() - last_refresh;
+  if (since >= frame_ticks) {
+    last_refresh += since;
+    refresh();
+    return;
+  }
+
+  // No timer slot left, don't wait for a callback that never comes
+  if (timetick_oneshot_deferred(&commit_cb, frame_ticks - since))
+    commit_armed = 1;
+  else {
+    last_refresh += since;
+    refresh();
+  }
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::setsync(uint8_t on) {
+  while (refreshing)
+    ;
+  sync_only = on;
+}
+
+template <class Bus>
+void ssd1306_core<Bus>::setframerate(uint8_t hz) {
+  frame_ticks = (hz && (hz < 100)) ? (100 / hz) : 1;
+}
+
+template <class Bus>
+uint8_t ssd1306_core<Bus>::refresh(void) {
+  if (refreshing)
+    return 0;
+  if (!dirty)
+    return 1;
+
+  // No irq on this bus or held off, send it now
+  if (!Bus::ASYNC || sync_only) {
+    display();
+    evt_handler_event(EVENT_DISP_DONE, 0);
+    return 1;
+  }
+  bus().bus_async_start();
+  return 1;
+}
+
+// Called by the bus with irqs off
+template <class Bus>
+void ssd1306_core<Bus>::begin_refresh(void) {
+  pend_lines = dirty;
+  dirty = 0;
+  refreshing = 1;
+  startline();
 }
 
 // clear everything
-void ssd1306::clear(void) {
+template <class Bus>
+void ssd1306_core<Bus>::clear(void) {
   uint8_t line;
   // Clear character buffer
   for (line = 0; line < LCD_CHAR_LINES; line++) {
@@ -210,9 +427,11 @@ void ssd1306::clear(void) {
   }
   // clear invert mask
   memset(invert_mask, 0, sizeof(invert_mask));
+  dirty = 0xff;
 }
 
-void ssd1306::poweroff(void)
+template <class Bus>
+void ssd1306_core<Bus>::poweroff(void)
 {
   // Turn off display
   ssd1306_command(SSD1306_DISPLAYOFF);
@@ -221,29 +440,9 @@ void ssd1306::poweroff(void)
   ssd1306_command(0x10);
 }
 
-void ssd1306::init(uint8_t vccstate) {
-  // set pin directions
-  LCD_CS_DDR |= _BV(LCD_CS_PIN);
-  LCD_DC_DDR |= _BV(LCD_DC_PIN);
-  LCD_RST_DDR |= _BV(LCD_RST_PIN);
-
-  // Set SPI Directions
-  DDRB |= (_BV(MOSI_PIN) | _BV(SCK_PIN));
-  // Clear SPI pwr saving bit
-  PRR0 &= ~(4);
-  // Enable SPI
-  //SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR0);
-  SPCR = (1<<SPE) | (1<<MSTR);  // 2Mhz clock
-
-  // Reset LCD
-  LCD_RST_PORT |= _BV(LCD_RST_PIN);
-  // VDD (3.3V) goes high at start, lets just chill for a ms
-  _delay_ms(1);
-  LCD_RST_PORT &= ~_BV(LCD_RST_PIN);
-  // wait 10ms
-  _delay_ms(10);
-  // bring out of reset
-  LCD_RST_PORT |= _BV(LCD_RST_PIN);
+template <class Bus>
+void ssd1306_core<Bus>::init(uint8_t vccstate) {
+  bus().bus_init();
 
   ssd1306_command(SSD1306_DISPLAYOFF);  // 0xAE
   ssd1306_command(SSD1306_SETLOWCOLUMN | 0x0);  // low col = 0
@@ -294,11 +493,118 @@ void ssd1306::init(uint8_t vccstate) {
 }
 
 /* Constructor */
-ssd1306::ssd1306 (void)
+template <class Bus>
+ssd1306_core<Bus>::ssd1306_core (void)
 {
   uint8_t i;
 
   // Clear all icons
   for (i = 0; i < LCD_MAX_ICON; i++)
     icon[i] = NULL;
+
+  // First display() draws everything
+  dirty = 0xff;
+  refreshing = 0;
+  sync_only = 0;
+  front = 0;
+  commit_armed = 0;
+  last_refresh = 0;
+  setframerate(30);
+}
+
+#ifdef SSD1306_HOST
+
+// Window commands take arguments, the rest are ignored
+void ssd1306_fb::bus_command(uint8_t c) {
+  if (nargs) {
+    nargs--;
+    if (cmd == SSD1306_COLUMNADDR) {
+      if (nargs)
+	col = col_lo = c & (LCD_WIDTH - 1);
+      else
+	col_hi = c & (LCD_WIDTH - 1);
+    }
+    else if (cmd == SSD1306_PAGEADDR) {
+      if (nargs)
+	page = page_lo = c & (LCD_CHAR_LINES - 1);
+      else
+	page_hi = c & (LCD_CHAR_LINES - 1);
+    }
+    return;
+  }
+
+  cmd = c;
+  switch (c) {
+    case SSD1306_COLUMNADDR:
+    case SSD1306_PAGEADDR:
+      nargs = 2;
+      break;
+    case SSD1306_SETCONTRAST:
+    case SSD1306_SETMULTIPLEX:
+    case SSD1306_SETDISPLAYOFFSET:
+    case SSD1306_SETDISPLAYCLOCKDIV:
+    case SSD1306_SETPRECHARGE:
+    case SSD1306_SETCOMPINS:
+    case SSD1306_SETVCOMDETECT:
+    case SSD1306_MEMORYMODE:
+    case SSD1306_CHARGEPUMP:
+      nargs = 1;
+      break;
+  }
 }
+
+#else
+
+static ssd1306_spi *refresh_disp;
+
+void ssd1306_spi::bus_init(void) {
+  // set pin directions
+  LCD_CS_DDR |= _BV(LCD_CS_PIN);
+  LCD_DC_DDR |= _BV(LCD_DC_PIN);
+  LCD_RST_DDR |= _BV(LCD_RST_PIN);
+
+  // Set SPI Directions
+  DDRB |= (_BV(MOSI_PIN) | _BV(SCK_PIN));
+  // Clear SPI pwr saving bit
+  PRR0 &= ~(4);
+  // Enable SPI
+  //SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR0);
+  SPCR = (1<<SPE) | (1<<MSTR);  // 2Mhz clock
+
+  // Reset LCD
+  LCD_RST_PORT |= _BV(LCD_RST_PIN);
+  // VDD (3.3V) goes high at start, lets just chill for a ms
+  _delay_ms(1);
+  LCD_RST_PORT &= ~_BV(LCD_RST_PIN);
+  // wait 10ms
+  _delay_ms(10);
+  // bring out of reset
+  LCD_RST_PORT |= _BV(LCD_RST_PIN);
+}
+
+void ssd1306_spi::bus_async_start(void) {
+  uint8_t sreg;
+
+  sreg = SREG;
+  cli();
+  refresh_disp = this;
+  LCD_CS_PORT |= _BV(LCD_CS_PIN);
+  LCD_CS_PORT &= ~_BV(LCD_CS_PIN);
+  // One irq per byte, at fosc/32 a byte takes 256 cycles and covers the
+  // ISR. At the 2MHz sync clock (32 cycles) the CPU never left it.
+  SPCR |= (1<<SPIE) | (1<<SPR1);
+  SPSR |= (1<<SPI2X);
+  begin_refresh();
+  SREG = sreg;
+}
+
+ISR(SPI_STC_vect)
+{
+  PROF_ENTER();
+  refresh_disp->isr_next();
+  PROF_EXIT(PROF_DISP_ISR);
+}
+
+#endif /* SSD1306_HOST */
+
+template class ssd1306_core<ssd1306>;
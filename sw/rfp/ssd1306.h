@@ -29,6 +29,8 @@
 #define SSD1306_SETHIGHCOLUMN 0x10
 #define SSD1306_SETSTARTLINE 0x40
 #define SSD1306_MEMORYMODE 0x20
+#define SSD1306_COLUMNADDR 0x21
+#define SSD1306_PAGEADDR 0x22
 #define SSD1306_COMSCANINC 0xC0
 #define SSD1306_COMSCANDEC 0xC8
 #define SSD1306_SEGREMAP 0xA0
@@ -62,30 +64,196 @@
 
 typedef uint8_t *(*icon_cb_t) (uint8_t idx);
 
-class ssd1306 {
+/**
+ * Driver core, shared by all buses. The bus is picked at compile time:
+ * Bus derives from ssd1306_core<Bus> and supplies these inline, so byte writes
+ * need no virtual call.
+ *   bus_init()            pins, bus and panel reset
+ *   bus_command(c)        single command byte
+ *   bus_begin/write/end   run of data bytes
+ *   ASYNC                 1 if refresh() can run from an irq, then
+ *   bus_async_start()     start it, calls begin_refresh() with irqs off
+ *   bus_dc(data), bus_put(c), bus_async_stop()   from the irq
+ */
+template <class Bus>
+class ssd1306_core {
 
  public:
-  ssd1306 (void);
+  ssd1306_core (void);
   void init(uint8_t switchvcc);
   void clear();
   void display();
   void poweroff();
 
+  // Background refresh, the SPI irq sends the dirty lines and posts
+  // EVENT_DISP_DONE. Returns 0 if a refresh is still running, lines
+  // drawn meanwhile stay dirty for the next one.
+  uint8_t refresh();
+  uint8_t busy() { return refreshing; }
+  // Send refreshes from the caller, no irq, while timing critical
+  // captures run. Waits out a background refresh.
+  void setsync(uint8_t on);
+  void isr_next();   // SPI transfer complete irq only
+
+  // Commit drawing. Starts a background refresh at most once per frame,
+  // commits within a frame collapse into one refresh at its end.
+  void commit();
+  void setframerate(uint8_t hz);
+
   // Draw functions
   void drawstring(uint8_t line, uint8_t x, const char *c, uint8_t invert);
   void drawbitmap(const uint8_t *bitmap, uint8_t w, uint8_t h);
   void drawicon(uint8_t index, uint8_t line, uint8_t x, uint8_t width);
   void registericon(uint8_t index, icon_cb_t cb);
   void clearline(uint8_t line);
-  virtual void ssd1306_command(uint8_t c);
-  virtual void ssd1306_data(uint8_t c);
+  // Force a line out on the next display(), e.g. icon bitmap changed
+  void invalidate(uint8_t line);
+  void ssd1306_command(uint8_t c);
+  void ssd1306_data(uint8_t c);
+  // Stream a run of data bytes with CS/DC set once
+  void ssd1306_datablock(const uint8_t *buf, uint16_t len);
+  void ssd1306_datablock_P(const uint8_t *buf, uint16_t len);
+
+ protected:
+  Bus &bus(void) { return *static_cast<Bus *>(this); }
+  void begin_refresh(void);
 
  private:
-  void spiwrite(uint8_t c);
+  void data_begin(void);
+  uint8_t rendercell(uint8_t line, uint8_t n, uint8_t *out);
+  uint8_t startline(void);
+  // background refresh state
+  volatile uint8_t refreshing;
+  uint8_t pend_lines, cur_line, cur_cell, cmd_idx, phase;
+  uint8_t cell[2][6];     // cell on the wire, next cell
+  uint8_t front, cell_len, next_len, byte_idx;
+  // frame limiter, in timeticks
+  uint8_t frame_ticks, commit_armed;
+  uint8_t sync_only;
+  uint16_t last_refresh;
+  static ssd1306_core *commit_disp;
+  static void commit_cb(uint16_t ticks);
+  void setpages(uint8_t start, uint8_t end);
+  // lines changed since the last display()
+  uint8_t dirty;
   // character buffer
   uint8_t buf[LCD_CHAR_LINES][LCD_CHAR_PER_LINE];
   // mask of inverted characters
   uint8_t invert_mask[LCD_CHAR_PER_LINE];
 };
 
+#ifdef SSD1306_HOST
+
+/**
+ * Host build: the panel is a 128 x 64 framebuffer in RAM, laid out like
+ * the GDDRAM (page major). Only the column/page window commands are
+ * interpreted. Refresh is synchronous. Built by test/makefile.
+ */
+class ssd1306_fb : public ssd1306_core<ssd1306_fb> {
+
+ public:
+  enum { ASYNC = 0 };
+  uint8_t fb[LCD_CHAR_LINES][LCD_WIDTH];
+
+ private:
+  friend class ssd1306_core<ssd1306_fb>;
+
+  void bus_init(void) {
+    col = col_lo = page = page_lo = 0;
+    col_hi = LCD_WIDTH - 1;
+    page_hi = LCD_CHAR_LINES - 1;
+    cmd = nargs = 0;
+  }
+  void bus_command(uint8_t c);
+  void bus_begin(void) { }
+  void bus_write(uint8_t c) {
+    fb[page][col] = c;
+    if (col++ < col_hi)
+      return;
+    col = col_lo;
+    page = (page < page_hi) ? page + 1 : page_lo;
+  }
+  void bus_end(void) { }
+  void bus_async_start(void) { }
+  void bus_dc(uint8_t data) { }
+  void bus_put(uint8_t c) { }
+  void bus_async_stop(void) { }
+
+  // addressing window and pending command arguments
+  uint8_t col, col_lo, col_hi, page, page_lo, page_hi;
+  uint8_t cmd, nargs;
+};
+
+typedef ssd1306_fb ssd1306;
+
+#else
+
+#include <avr/io.h>
+
+/**
+ * Device build: hardware SPI, CS/DC/RST on GPIO. Data runs write each
+ * byte as soon as the previous one has left at 2MHz. Refresh runs from the
+ * SPI transfer complete irq at fosc/32, slow enough that the main loop
+ * keeps most of the CPU.
+ */
+class ssd1306_spi : public ssd1306_core<ssd1306_spi> {
+
+ public:
+  enum { ASYNC = 1 };
+
+ private:
+  friend class ssd1306_core<ssd1306_spi>;
+
+  void bus_init(void);
+  void bus_command(uint8_t c) {
+    LCD_CS_PORT |= _BV(LCD_CS_PIN);
+    LCD_DC_PORT &= ~_BV(LCD_DC_PIN);
+    LCD_CS_PORT &= ~_BV(LCD_CS_PIN);
+    SPDR = c;
+    while(!(SPSR & (1<<SPIF)))
+      ;
+    LCD_CS_PORT |= _BV(LCD_CS_PIN);
+  }
+  void bus_begin(void) {
+    LCD_CS_PORT |= _BV(LCD_CS_PIN);
+    LCD_DC_PORT |= _BV(LCD_DC_PIN);
+    LCD_CS_PORT &= ~_BV(LCD_CS_PIN);
+    streaming = 0;
+  }
+  void bus_write(uint8_t c) {
+    if (streaming)
+      while(!(SPSR & (1<<SPIF)))
+	;
+    SPDR = c;
+    streaming = 1;
+  }
+  void bus_end(void) {
+    if (streaming)
+      while(!(SPSR & (1<<SPIF)))
+	;
+    streaming = 0;
+    LCD_CS_PORT |= _BV(LCD_CS_PIN);
+  }
+  void bus_async_start(void);
+  void bus_dc(uint8_t data) {
+    if (data)
+      LCD_DC_PORT |= _BV(LCD_DC_PIN);
+    else
+      LCD_DC_PORT &= ~_BV(LCD_DC_PIN);
+  }
+  void bus_put(uint8_t c) { SPDR = c; }
+  void bus_async_stop(void) {
+    LCD_CS_PORT |= _BV(LCD_CS_PIN);
+    SPCR &= ~((1<<SPIE) | (1<<SPR1));
+    SPSR &= ~(1<<SPI2X);
+  }
+
+  // byte in flight on the SPI during a data run
+  uint8_t streaming;
+};
+
+typedef ssd1306_spi ssd1306;
+
+#endif /* SSD1306_HOST */
+
 #endif /* _SSD1306_H_ */
@@ -18,6 +18,7 @@
 #define EVENT_SD_DET           0x12
 #define EVENT_SD_RMV           0x13
 #define EVENT_ICON_UPDT        0x14
+#define EVENT_DISP_DONE        0x15  // background display refresh finished
 
 // App events
 #define EVENT_APP_START        0x20
@@ -26,22 +27,18 @@
 // Serial events
 #define EVENT_SERIAL_RECV      0x30
 
-// RF IRQ events
-#define EVENT_ISR_FIFO_UNDOVR  0x40
-#define EVENT_ISR_FIFO_TXHI    0x41
-#define EVENT_ISR_FIFO_TXLO    0x42
-#define EVENT_ISR_FIFO_RXHI    0x43
-#define EVENT_ISR_EXT_INTEN    0x44
-#define EVENT_ISR_PKT_SENT     0x45
-#define EVENT_ISR_PKT_RCVD     0x46
-#define EVENT_ISR_CRC_ERR      0x47
-#define EVENT_ISR_SYNC_DET     0x48
-#define EVENT_ISR_VAL_PRM_DET  0x49
-#define EVENT_ISR_INV_PRM_DET  0x4A
-#define EVENT_ISR_RSSI         0x4B
-#define EVENT_ISR_WAKE_TMR     0x4C
-#define EVENT_ISR_LOW_BATT     0x4D
-#define EVENT_ISR_XTAL_RDY     0x4E
-#define EVENT_ISR_POR_EN       0x4F
+// RF IRQ event, data = ISR_* status mask
+#define EVENT_RF_IRQ           0x40
+
+// RF driver events
+#define EVENT_RF_RX_DATA       0x50  // data = bytes in rx ring
+#define EVENT_RF_SCAN_HIT      0x51  // data = active channel
+#define EVENT_RF_SWEEP_DONE    0x52  // data = rf_sweep_frame() index
+#define EVENT_RF_RAW_DATA      0x53  // data = pulses captured
+#define EVENT_RF_RAW_TX_DONE   0x54  // replay finished
+#define EVENT_RF_TX_DONE       0x55  // data = bytes sent
+
+// Timetick events
+#define EVENT_TIMER            0x60  // deferred timers expired
 
 #endif /* _EVENTS_H_ */
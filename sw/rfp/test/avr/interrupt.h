@@ -0,0 +1,11 @@
+#ifndef _HOST_INTERRUPT_H_
+#define _HOST_INTERRUPT_H_
+/*
+ * Host stand-in for avr-libc irq control, nothing preempts the host build.
+ */
+#include <avr/io.h>
+
+#define cli()
+#define sei()
+
+#endif /* _HOST_INTERRUPT_H_ */
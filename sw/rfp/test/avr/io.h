@@ -0,0 +1,12 @@
+#ifndef _HOST_IO_H_
+#define _HOST_IO_H_
+/*
+ * Host stand-in for the avr-libc register file. Only the status register
+ * is modelled, for the save/cli/restore sections, it lives in host.cpp.
+ */
+#include <stdint.h>
+
+extern volatile uint8_t host_sreg;
+#define SREG  host_sreg
+
+#endif /* _HOST_IO_H_ */
@@ -0,0 +1,13 @@
+#ifndef _HOST_PGMSPACE_H_
+#define _HOST_PGMSPACE_H_
+/*
+ * Host stand-in for avr-libc flash access, flash is plain memory here.
+ */
+#include <string.h>
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p)      (*(const uint8_t *)(p))
+#define memcpy_P(d, s, n)     memcpy((d), (s), (n))
+
+#endif /* _HOST_PGMSPACE_H_ */
@@ -0,0 +1,42 @@
+/*
+ * Host stand-ins for the status register and the timetick driver. One
+ * deferred one-shot slot, enough for the display frame limiter.
+ */
+#include <stddef.h>
+#include <avr/io.h>
+
+#include "host.h"
+
+volatile uint8_t host_sreg;
+
+static uint16_t count;
+static timetick_cb_t oneshot_cb;
+static uint16_t oneshot_deadline;
+
+uint16_t timetick_getcount(void)
+{
+  return count;
+}
+
+uint8_t timetick_oneshot_deferred(timetick_cb_t cb, uint16_t ticks)
+{
+  if (oneshot_cb != NULL)
+    return 0;
+  oneshot_cb = cb;
+  oneshot_deadline = count + ticks;
+  return 1;
+}
+
+void host_tick(uint16_t ticks)
+{
+  timetick_cb_t cb;
+
+  while (ticks--) {
+    count++;
+    if ((oneshot_cb != NULL) && (count == oneshot_deadline)) {
+      cb = oneshot_cb;
+      oneshot_cb = NULL;
+      cb(count);
+    }
+  }
+}
@@ -0,0 +1,13 @@
+#ifndef _HOST_H_
+#define _HOST_H_
+/*
+ * Host stand-ins for the device services the UI modules call. Time only
+ * moves when a test calls host_tick().
+ */
+#include <stdint.h>
+#include "timetick.h"
+
+// Advance the tick count, running deferred one-shots as they expire
+void host_tick(uint16_t ticks);
+
+#endif /* _HOST_H_ */
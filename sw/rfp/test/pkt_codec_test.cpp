@@ -0,0 +1,108 @@
+/*
+ * Host test, encode -> decode round trips for every line code, through
+ * both the FIFO bitstream and the raw pulse decoder.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "pkt_codec.h"
+
+static int fails;
+
+#define CHECK(cond, ...) do {			\
+    if (!(cond)) {				\
+      printf("FAIL %s:%d ", __FILE__, __LINE__);	\
+      printf(__VA_ARGS__);			\
+      printf("\n");				\
+      fails++;					\
+    }						\
+  } while (0)
+
+static const packet_format_t manchester_format = {
+  500, 1, 1, 8, 4, 6, ENCODE_MANCHESTER, 16
+};
+
+static const packet_format_t nrz_format = {
+  250, 1, 1, 12, 8, 8, ENCODE_NRZ, 16
+};
+
+// Preamble high runs shorter than the header one, must not add up
+static const packet_format_t short_pre_format = {
+  400, 1, 3, 4, 2, 3, ENCODE_NRZ, 8
+};
+
+// Chip stream (os = 1) to alternating pulse lengths, +-jitter us
+static uint8_t to_pulses (const pkt_codec_t *c, const uint8_t *fifo,
+			  uint16_t nbits, uint16_t *pulses, int jitter)
+{
+  uint16_t bit;
+  uint8_t n = 0, level, run = 0;
+
+  level = fifo[0] >> 7;
+  for (bit = 0; bit < nbits; bit++) {
+    uint8_t b = (fifo[bit >> 3] >> (7 - (bit & 7))) & 1;
+    if (b != level) {
+      pulses[n] = run * c->fmt.bit_time_us + ((n & 1) ? jitter : -jitter);
+      n++;
+      level = b;
+      run = 0;
+    }
+    run++;
+  }
+  pulses[n++] = run * c->fmt.bit_time_us;
+  return n;
+}
+
+static void round_trip (const char *name, const packet_format_t *fmt,
+			const uint8_t *payload)
+{
+  pkt_codec_t c;
+  uint8_t fifo[128], out[16], len, n, bits, os;
+  uint16_t pulses[256];
+  uint8_t bytes = (fmt->data_bc + 7) >> 3;
+
+  for (os = 1; os <= PKT_MAX_OS; os++) {
+    CHECK(pkt_codec_init(&c, fmt, os), "%s init os=%u", name, os);
+    len = pkt_encode(&c, payload, fifo, sizeof(fifo));
+    CHECK(len, "%s encode os=%u", name, os);
+
+    bits = pkt_decode_bits(&c, fifo, len * 8, out);
+    CHECK(bits == fmt->data_bc, "%s bits os=%u: %u of %u", name, os,
+	  bits, fmt->data_bc);
+    CHECK(!memcmp(out, payload, bytes), "%s payload os=%u, first %02x",
+	  name, os, out[0]);
+  }
+
+  // Pulses, with idle in front like a capture
+  pkt_codec_init(&c, fmt, 1);
+  len = pkt_encode(&c, payload, fifo, sizeof(fifo));
+  pulses[0] = 0xffff;
+  n = to_pulses(&c, fifo, len * 8, &pulses[1], c.fmt.bit_time_us / 5);
+  bits = pkt_decode_pulses(&c, pulses, n + 1, 0, out);
+  CHECK(bits == fmt->data_bc, "%s pulse bits: %u of %u", name,
+	bits, fmt->data_bc);
+  CHECK(!memcmp(out, payload, bytes), "%s pulse payload, first %02x",
+	name, out[0]);
+}
+
+int main (void)
+{
+  // First payload bit 0 and 1, plus a zero and all ones pattern
+  static const uint8_t p0[9] = { 0x3c, 0xa4, 0x55, 0xaa, 0x00, 0xff, 0x12, 0x34, 0x02 };
+  static const uint8_t p1[9] = { 0xa5, 0x3c, 0x0f, 0xf0, 0x81, 0x7e, 0xde, 0xad, 0x01 };
+  static const uint8_t pz[9] = { 0 };
+  static const uint8_t po[9] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x03 };
+  const uint8_t *pl[] = { p0, p1, pz, po };
+  uint8_t i;
+
+  for (i = 0; i < sizeof(pl) / sizeof(pl[0]); i++) {
+    round_trip("keeloq", &keeloq_format, pl[i]);
+    round_trip("manchester", &manchester_format, pl[i]);
+    round_trip("nrz", &nrz_format, pl[i]);
+    round_trip("short preamble", &short_pre_format, pl[i]);
+  }
+
+  printf("pkt_codec: %s\n", fails ? "FAILED" : "ok");
+  return fails ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Host test, renders the menu through the framebuffer panel and reads
+ * the glyphs back: header, entries, selection and the frame limiter.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "system.h"
+#include "Menu.h"
+
+static int fails;
+
+#define CHECK(cond, ...) do {			\
+    if (!(cond)) {				\
+      printf("FAIL %s:%d ", __FILE__, __LINE__);	\
+      printf(__VA_ARGS__);			\
+      printf("\n");				\
+      fails++;					\
+    }						\
+  } while (0)
+
+// Font table, defined in ssd1306.cpp
+extern unsigned char font[];
+
+static void nop(void) { }
+
+static MenuEntry m_radio[] = {
+  MenuEntry ("Rx", &nop),
+  MenuEntry ("Tx", &nop),
+  NULL
+};
+
+static MenuEntry m_root[] = {
+  MenuEntry ("Radio", m_radio),
+  MenuEntry ("Scan", &nop),
+  MenuEntry ("About"),
+  NULL
+};
+
+// Two cell icon, 6 columns each
+static uint8_t icon_bm[12] = {
+  0x3c, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x3c, 0x18
+};
+
+static uint8_t *icon_cb(uint8_t idx)
+{
+  return icon_bm;
+}
+
+static ssd1306 oled;
+static Menu menu(m_root, &oled, 1, 5);
+
+// Read a line back as text, inv gets '#' for inverted cells else '.'
+static void readline(uint8_t line, char *text, char *inv)
+{
+  uint8_t n, i, c, len = 0;
+  uint8_t glyph[5];
+
+  for (n = 0; n < LCD_CHAR_PER_LINE; n++) {
+    // Spacer column is set on inverted cells
+    c = (oled.fb[line][n * 6 + 5] == 0xff) ? 0xff : 0;
+    for (i = 0; i < 5; i++)
+      glyph[i] = oled.fb[line][n * 6 + i] ^ c;
+
+    text[n] = '?';
+    for (i = 0; i < 128; i++) {
+      if (!memcmp(&font[i * 5], glyph, 5)) {
+	text[n] = i ? i : ' ';
+	break;
+      }
+    }
+    inv[n] = c ? '#' : '.';
+    if (text[n] != ' ' || c)
+      len = n + 1;
+  }
+  text[len] = inv[len] = 0;
+}
+
+static void check_line(uint8_t line, const char *text, const char *inv)
+{
+  char t[LCD_CHAR_PER_LINE + 1], v[LCD_CHAR_PER_LINE + 1];
+
+  readline(line, t, v);
+  CHECK(!strcmp(t, text), "line %u text '%s' want '%s'", line, t, text);
+  CHECK(!strcmp(v, inv), "line %u invert '%s' want '%s'", line, v, inv);
+}
+
+int main(void)
+{
+  evt_handler_init();
+  oled.init(SSD1306_SWITCHCAPVCC);
+  oled.clear();
+  memset(oled.fb, 0x55, sizeof(oled.fb));
+
+  // First frame waits for the frame limiter
+  host_tick(1);
+  menu.DrawMenu();
+  CHECK(oled.fb[0][0] == 0x55, "refresh before the frame ended");
+  host_tick(2);
+  check_line(0, "[MENU]", "......");
+  check_line(1, " Radio" DIR_ICON, "######.");
+  check_line(2, "Scan", "....");
+  check_line(3, "About", ".....");
+  check_line(4, "", "");
+  CHECK(oled.fb[7][127] == 0, "untouched line not cleared");
+
+  // Selection moves down
+  menu.KeyHandler(KEY_DOWN);
+  host_tick(3);
+  check_line(1, "Radio" DIR_ICON, "......");
+  check_line(2, " Scan", "#####");
+
+  // Into the branch, header shows the parent
+  menu.KeyHandler(KEY_UP);
+  host_tick(3);
+  menu.KeyHandler(KEY_RIGHT);
+  host_tick(3);
+  check_line(0, "[Radio]", ".......");
+  check_line(1, " Rx", "###");
+  check_line(2, "Tx", "..");
+  check_line(3, "", "");
+
+  // And back out
+  menu.KeyHandler(KEY_LEFT);
+  host_tick(3);
+  check_line(0, "[MENU]", "......");
+  check_line(1, " Radio" DIR_ICON, "######.");
+
+  // Icons land in their cells, out of range ones are dropped
+  oled.registericon(0, &icon_cb);
+  oled.drawicon(0, 7, 19, 2);
+  oled.drawicon(0, LCD_CHAR_LINES, 0, 2);
+  oled.drawicon(0, 0xff, 0, 2);
+  oled.drawicon(LCD_MAX_ICON, 6, 0, 2);
+  menu.DrawMenu();
+  host_tick(3);
+  CHECK(!memcmp(&oled.fb[7][19 * 6], icon_bm, sizeof(icon_bm)),
+	"icon not drawn");
+  check_line(1, " Radio" DIR_ICON, "######.");
+  check_line(2, "Scan", "....");
+  check_line(6, "", "");
+
+  if (fails) {
+    printf("ui: %d failures\n", fails);
+    return 1;
+  }
+  printf("ui: ok\n");
+  return 0;
+}
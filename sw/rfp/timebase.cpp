@@ -0,0 +1,38 @@
+/*
+ * Free running 32-bit microsecond timebase on Timer3.
+ */
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timebase.h"
+
+volatile uint16_t timebase_ovf;
+
+ISR(TIMER3_OVF_vect)
+{
+  timebase_ovf++;
+}
+
+void timebase_init (void)
+{
+  timebase_ovf = 0;
+
+  // Normal mode, clk/8 = 1us
+  TCCR3A = 0;
+  TCCR3C = 0;
+  TCNT3 = 0;
+  TIFR3 = (1 << TOV3);
+  TIMSK3 = (1 << TOIE3);
+  TCCR3B = (1 << CS31);
+}
+
+uint32_t timebase_us (void)
+{
+  uint32_t t;
+  uint8_t sreg = SREG;
+
+  cli();
+  t = timebase_us_isr();
+  SREG = sreg;
+  return t;
+}
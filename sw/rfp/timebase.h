@@ -0,0 +1,30 @@
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+/*
+ * Free running 32-bit microsecond timebase. Timer3 counts at clk/8 = 1us
+ * and its overflow irq extends it to 32 bits (wraps after ~71 minutes).
+ * Differences of two stamps are valid across the wrap.
+ */
+#include <stdint.h>
+#include <avr/io.h>
+
+void timebase_init (void);
+
+// Atomic read, any context
+uint32_t timebase_us (void);
+
+// Overflow count, only for the inline read below
+extern volatile uint16_t timebase_ovf;
+
+// Read with irqs already off (ISRs), accounts for a pending overflow
+static inline uint32_t timebase_us_isr (void)
+{
+  uint16_t lo = TCNT3;
+  uint16_t hi = timebase_ovf;
+
+  if ((TIFR3 & (1 << TOV3)) && !(lo & 0x8000))
+    hi++;
+  return ((uint32_t)hi << 16) | lo;
+}
+
+#endif /* _TIMEBASE_H_ */
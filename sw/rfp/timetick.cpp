@@ -1,50 +1,157 @@
 /*
  * Timetick driver - Ticks once every 10 ms.
- * Callbacks are synchronous. Do not do any heavy lifting!! Instead post
- * an event to the event queue.
+ * Plain callbacks run in the timer ISR. Do not do any heavy lifting!!
+ * Deferred timers are only flagged here and run from the main loop.
  *
  * Elliot Buller 2012
  */
 #include <string.h>
 
 #include "timetick.h"
+#include "evt_handler.h"
+#include "prof.h"
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
 // How many clients can register
-#define CLIENT_CNT  5
+#define CLIENT_CNT  8
 
-// internal struct to track clients
+// internal struct to track clients, linked in deadline order
 struct client_t {
-  uint16_t           ticks;
-  timetick_cb_t      cb;
+  timetick_cb_t      cb;       // NULL when slot is free
+  uint16_t           period;   // 0 for one-shot
+  uint16_t           deadline;
+  uint8_t            linked;
+  uint8_t            deferred; // run from the main loop
+  struct client_t   *next;
 };
 
 // Private variables
-static uint16_t count;
+static volatile uint16_t count;
 static struct client_t client[CLIENT_CNT];
+static struct client_t *head;
+
+// Expired deferred callbacks, waiting for the main loop
+static timetick_cb_t volatile pend_cb[CLIENT_CNT];
+static volatile uint8_t pend_run;   // pend_cb has entries
+static volatile uint8_t pend_evt;   // EVENT_TIMER queued for them
 
 // Compare value for ~10ms
 #define CMP_VAL  78
 
-// Interrupt
+// Longest sleep one 8 bit compare period can cover
+#define TICK_CNT      (CMP_VAL + 1)
+#define MAX_STRETCH   (256 / TICK_CNT)
+
+// Ticks covered by the current compare period
+static volatile uint8_t tick_step = 1;
+
+// Wrap safe, true if tick a is at or past b
+#define TICK_DUE(a, b)  ((int16_t)((a) - (b)) >= 0)
+
+// Insert in deadline order, irqs off
+static void link_client (struct client_t *c)
+{
+  struct client_t **p = &head;
+
+  while (*p && TICK_DUE(c->deadline, (*p)->deadline))
+    p = &(*p)->next;
+  c->next = *p;
+  *p = c;
+  c->linked = 1;
+}
+
+static void unlink_client (struct client_t *c)
+{
+  struct client_t **p = &head;
+
+  while (*p && (*p != c))
+    p = &(*p)->next;
+  if (*p)
+    *p = c->next;
+  c->linked = 0;
+}
+
+// Interrupt, only expired timers are touched
 ISR(TIMER0_COMPA_vect) {
-  uint8_t i;
+  struct client_t *c;
+  uint16_t now;
+  PROF_ENTER();
 
-  for (i = 0; i < CLIENT_CNT; i++) {
-    if (client[i].cb && (count % client[i].ticks == 0)) {
-      client[i].cb(count);
+  // Back to single ticks after a stretched idle period
+  now = count + tick_step;
+  count = now;
+  if (tick_step > 1) {
+    tick_step = 1;
+    OCR0A = CMP_VAL;
+  }
+
+  while (head && TICK_DUE(now, head->deadline)) {
+    c = head;
+    head = c->next;
+    c->linked = 0;
+
+    // Deferred timers only get flagged, one event covers all of them
+    if (c->deferred) {
+      pend_cb[c - client] = c->cb;
+      pend_run = 1;
     }
+    else
+      c->cb(now);
+
+    // Callback may have deregistered (or reused) the slot
+    if (c->cb && c->period && !c->linked) {
+      c->deadline += c->period;
+      link_client(c);
+    }
+    else if (!c->linked)
+      c->cb = NULL;
+  }
+
+  // Queue may be full, try again every tick until the event is in
+  if (pend_run && !pend_evt)
+    pend_evt = evt_handler_event(EVENT_TIMER, now);
+  PROF_EXIT(PROF_TICK);
+}
+
+// Run expired deferred timers, main loop context
+static uint8_t timetick_event_notify (uint8_t event, uint16_t data)
+{
+  timetick_cb_t cb;
+  uint8_t i, sreg;
+
+  // Timers expiring from here on post a new event
+  sreg = SREG;
+  cli();
+  pend_run = 0;
+  pend_evt = 0;
+  SREG = sreg;
+  for (i = 0; i < CLIENT_CNT; i++) {
+    sreg = SREG;
+    cli();
+    cb = pend_cb[i];
+    pend_cb[i] = NULL;
+    SREG = sreg;
+    if (cb)
+      cb(data);
   }
-  count++;
+  return 1;
 }
 
 void timetick_init(void)
 {
   count = 0;
+  head = NULL;
+  pend_run = 0;
+  pend_evt = 0;
   
   // Clear on clients
   memset (client, 0, sizeof(client));
+  memset ((void *)pend_cb, 0, sizeof(pend_cb));
+
+  // Deferred timers come back through the dispatcher
+  evt_handler_subscribe(&timetick_event_notify, EVT_MASK_TIMER);
 
   // Setup TIMER0
   TCCR0A = 2;             // cnt up to OCR0A
@@ -66,28 +173,125 @@ static struct client_t *find_client (timetick_cb_t cb)
   return NULL;
 }
 
+static uint8_t add_client (timetick_cb_t cb, uint16_t ticks,
+			   uint16_t period, uint8_t deferred)
+{
+  struct client_t *c;
+  uint8_t sreg;
+
+  if ((cb == NULL) || (ticks == 0))
+    return 0;
+
+  sreg = SREG;
+  cli();
+  c = find_client(NULL);
+  if (c != NULL) {
+    c->cb = cb;
+    c->period = period;
+    c->deferred = deferred;
+    c->deadline = count + ticks;
+    link_client(c);
+  }
+  SREG = sreg;
+  return c != NULL;
+}
 
-void timetick_register(timetick_cb_t cb, uint16_t ticks)
+uint8_t timetick_register(timetick_cb_t cb, uint16_t ticks)
 {
-  struct client_t *c = find_client(NULL);
-  if (c == NULL)
-    return;
-  
-  c->cb = cb;
-  c->ticks = ticks;
+  return add_client(cb, ticks, ticks, 0);
+}
+
+uint8_t timetick_oneshot(timetick_cb_t cb, uint16_t ticks)
+{
+  return add_client(cb, ticks, 0, 0);
+}
+
+uint8_t timetick_register_deferred(timetick_cb_t cb, uint16_t ticks)
+{
+  return add_client(cb, ticks, ticks, 1);
+}
+
+uint8_t timetick_oneshot_deferred(timetick_cb_t cb, uint16_t ticks)
+{
+  return add_client(cb, ticks, 0, 1);
 }
 
 void timetick_deregister(timetick_cb_t cb)
 {
-  struct client_t *c = find_client(cb);
-  if (c == NULL)
+  struct client_t *c;
+  uint8_t i, sreg;
+
+  if (cb == NULL)
     return;
-  
-  c->cb = NULL;
-  c->ticks = 0;
+
+  sreg = SREG;
+  cli();
+  c = find_client(cb);
+  if (c != NULL) {
+    if (c->linked)
+      unlink_client(c);
+    c->cb = NULL;
+  }
+  // Drop a pending deferred run too
+  for (i = 0; i < CLIENT_CNT; i++) {
+    if (pend_cb[i] == cb)
+      pend_cb[i] = NULL;
+  }
+  SREG = sreg;
+}
+
+// Woken early, account the ticks already elapsed and go back to 10ms
+static void timetick_resume (void)
+{
+  uint8_t n;
+
+  if ((tick_step == 1) || (TIFR0 & (1<<OCF0A)))
+    return;
+
+  n = TCNT0 / TICK_CNT;
+  TCNT0 -= n * TICK_CNT;
+  count += n;
+  tick_step = 1;
+  OCR0A = CMP_VAL;
+}
+
+void timetick_idle(uint8_t (*pending)(void))
+{
+  uint16_t left = MAX_STRETCH;
+
+  cli();
+  if (pending()) {
+    sei();
+    return;
+  }
+
+  // Stretch the tick up to the next deadline, only from a period start
+  if (head)
+    left = head->deadline - count;
+  if ((left > 1) && (TCNT0 < TICK_CNT) && !(TIFR0 & (1<<OCF0A))) {
+    tick_step = (left < MAX_STRETCH) ? left : MAX_STRETCH;
+    OCR0A = tick_step * TICK_CNT - 1;
+  }
+
+  // Idle keeps clkIO running for Timer0, USB and the radio pins
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sei();
+  sleep_cpu();
+  sleep_disable();
+
+  cli();
+  timetick_resume();
+  sei();
 }
 
 uint16_t timetick_getcount(void)
 {
-  return count;
+  uint16_t c;
+  uint8_t sreg = SREG;
+
+  cli();
+  c = count;
+  SREG = sreg;
+  return c;
 }
@@ -2,8 +2,9 @@
 #define _TIMETICK_H_
 /*
  * Timetick driver - Ticks once every 10 ms.
- * Callbacks are synchronous. Do not do any heavy lifting!! Instead post
- * an event to the event queue.
+ * Plain callbacks run in the timer ISR. Do not do any heavy lifting!!
+ * Use a deferred timer instead, the ISR only flags it and the callback
+ * runs from the main loop through the event dispatcher (EVENT_TIMER).
  *
  * Elliot Buller 2012
  */
@@ -13,10 +14,20 @@
 // Callback method type
 typedef void (*timetick_cb_t)(uint16_t ticks);
 
-// Timetick public methods
+// Timetick public methods. Timers live on a deadline sorted list so a
+// tick only touches expired ones. Periods up to 32767 ticks. Deregister is
+// safe from any callback, including the timer's own. Adding returns 0
+// when all client slots are taken.
 void timetick_init(void);
-void timetick_register(timetick_cb_t cb, uint16_t ticks);
+uint8_t timetick_register(timetick_cb_t cb, uint16_t ticks);   // periodic
+uint8_t timetick_oneshot(timetick_cb_t cb, uint16_t ticks);    // fires once
+uint8_t timetick_register_deferred(timetick_cb_t cb, uint16_t ticks);
+uint8_t timetick_oneshot_deferred(timetick_cb_t cb, uint16_t ticks);
 void timetick_deregister(timetick_cb_t cb);
 uint16_t timetick_getcount(void);
 
+// Sleep until the next interrupt unless pending() reports work. The tick
+// is stretched to the next timer deadline, up to 3 ticks per wake.
+void timetick_idle(uint8_t (*pending)(void));
+
 #endif /* _TIMETICK_H_ */
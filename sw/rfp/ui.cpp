@@ -13,6 +13,7 @@
 
 #include "cmd_parser.h"
 #include "timetick.h"
+#include "timebase.h"
 #include "keypad.h"
 #include "hw.h"
 #include "usb_serial.h"
@@ -59,6 +60,7 @@ void (*bootloader) (void) = (void (*)())0x3800;
 //void (*bootloader) (void) = (void (*)())0x7000;
 
 void shutdown ();
+void UpdateStatus (const char *str);
 void fast_charge_on(void) { HIGH(usb_i_sel); oled.poweroff(); }
 void jmp_bootloader(void) { 
   cli(); 
@@ -67,10 +69,24 @@ void jmp_bootloader(void) {
   bootloader(); 
 }
 
+// Show event queue peak depth and losses
+void evt_stats(void)
+{
+  char str[21];
+
+  // peak/dropped for rf, input, housekeeping
+  snprintf(str, sizeof(str), "%u/%u %u/%u %u/%u",
+	   evt_handler_hwm(EVT_PRIO_RF), evt_handler_drops(EVT_PRIO_RF),
+	   evt_handler_hwm(EVT_PRIO_INPUT), evt_handler_drops(EVT_PRIO_INPUT),
+	   evt_handler_hwm(EVT_PRIO_HOUSE), evt_handler_drops(EVT_PRIO_HOUSE));
+  UpdateStatus(str);
+}
+
 // Todo move to menu file
 MenuEntry m_root[] = {
   MenuEntry ("RF", m_rf_root, &rf_event_notify),
   MenuEntry ("RF Debug", m_rf_debug, &rf_debug_notify),
+  MenuEntry ("Event stats", &evt_stats),
   MenuEntry ("Bootloader", &jmp_bootloader),
   MenuEntry ("Shutdown", &shutdown),
   NULL
@@ -92,7 +108,7 @@ void led_keepalive (uint16_t ticks) {
 void UpdateStatus (const char *str) {
   oled.clearline(6);
   oled.drawstring(6, 0, str, 0);
-  oled.display();
+  oled.commit();
 }
 
 
@@ -119,6 +135,9 @@ static void UpdateVbatt (uint8_t level)
   else {
     batt_icon = batt_0p0;
   }
+
+  // Icon lives on line 7, redraw it with the next update
+  oled.invalidate(7);
 }
 
 uint8_t *icon_cb (uint8_t idx)
@@ -159,6 +178,11 @@ static uint8_t ui_event_notify (uint8_t event, uint16_t data)
       UpdateVbatt ((uint8_t)data);
       break;
 
+    case EVENT_DISP_DONE:
+      // Pick up lines drawn while the last refresh was running
+      oled.commit();
+      break;
+
     case EVENT_SERIAL_RECV:
       cmdp_parse_cmd((string_t *)data);
       break;
@@ -172,7 +196,7 @@ static uint8_t ui_event_notify (uint8_t event, uint16_t data)
   return 1;
 }
 
-// TODO: Move to main
+// Deferred timer, runs in the main loop
 void process_usb (uint16_t ticks) {
   ser.process();
 }
@@ -182,8 +206,9 @@ void ui_setup(void)
   // Register self as initial event handler, never gets popped
   evt_handler_addhandler(&ui_event_notify);
 
-  // Init Timetick subsystem
+  // Init Timetick subsystem and us timebase
   timetick_init();
+  timebase_init();
 
   // Init command parser
   cmdp_init();
@@ -193,8 +218,8 @@ void ui_setup(void)
   HIGH(led);
   timetick_register(&led_keepalive, 50);
 
-  // process usb every 20ms
-  timetick_register(&process_usb, 2);
+  // process usb every 20ms, outside of irq context
+  timetick_register_deferred(&process_usb, 2);
 
   // Start keypad - sample at 70ms
   keypad_init(7);
@@ -219,4 +244,7 @@ void ui_process(void)
   // Dispatch any outstanding events
   // TODO: move somewhere else
   evt_handler_dispatch();
+
+  // Nothing left to do, sleep until the next irq
+  timetick_idle(&evt_handler_pending);
 }
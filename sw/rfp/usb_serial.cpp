@@ -15,6 +15,9 @@ UsbSerial::UsbSerial (void)
   // init class data
   rx_p = rx_idx = 0;
   tx_h = tx_t = 0;
+  tx_bin = NULL;
+  tx_bin_len = 0;
+  tx_bin_cb = NULL;
 
   for (i = 0; i < RX_DEPTH; i++) {
     rx_q[i].data[0] = '\0';
@@ -91,11 +94,35 @@ void UsbSerial::process (void)
     WRAP(tx_t, TX_DEPTH);
   }
 
+  // send queued binary block raw
+  if (tx_bin != NULL) {
+    const uint8_t *p = tx_bin;
+    uint8_t n = tx_bin_len;
+
+    while (n--)
+      CDC_Device_SendByte(&VirtualSerial_CDC_Interface, *p++);
+    tx_bin = NULL;
+    if (tx_bin_cb != NULL)
+      tx_bin_cb();
+  }
+
   // call usb stack processing
   CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
   USB_USBTask();
 }
 
+/* Queue a binary block, returns 0 if the previous one is still pending */
+uint8_t UsbSerial::write (const uint8_t *buf, uint8_t len, serial_sent_cb cb)
+{
+  if (tx_bin != NULL)
+    return 0;
+
+  tx_bin_len = len;
+  tx_bin_cb = cb;
+  tx_bin = buf;
+  return 1;
+}
+
 void UsbSerial::printf (const char *fmt, ...)
 {
   va_list args;
@@ -14,6 +14,7 @@
 // defined in Descriptors.c
 extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface;
 typedef void (*serial_recv_cb)(char *buf, uint8_t len);
+typedef void (*serial_sent_cb)(void);
 
 // Used by clients to release buffer after processing
 #define RELEASE_BUF(x) (x[0]='\0')
@@ -37,6 +38,8 @@ class UsbSerial {
   UsbSerial(void);                          // constructor
   void process(void);                       // process input and output
   void printf(const char *fmt, ...);        // buffered printf
+  // queue binary block, cb runs once it has gone out
+  uint8_t write(const uint8_t *buf, uint8_t len, serial_sent_cb cb = NULL);
 
  private:
   void buffer_rx(char b);
@@ -46,6 +49,10 @@ class UsbSerial {
   // Track head/tail of each buffer
   uint8_t rx_p, rx_idx;
   uint8_t tx_h, tx_t;
+  // Binary block, not copied. Caller keeps buf intact until sent
+  const uint8_t * volatile tx_bin;
+  uint8_t tx_bin_len;
+  serial_sent_cb tx_bin_cb;
   // Storage
   char tx_q[TX_DEPTH][USB_SERIAL_BUF_SZ];
   string_t rx_q[RX_DEPTH];